@@ -1,131 +1,734 @@
 #include "BVH.hpp"
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <future>
+#include <thread>
 
-BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode, SplitMethod splitMethod)
-    : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
+struct BVHPrimitiveInfo {
+    BVHPrimitiveInfo() {}
+    BVHPrimitiveInfo(size_t primitiveNumber, const Bounds3& bounds)
+        : primitiveNumber(primitiveNumber), bounds(bounds),
+        centroid(.5f * bounds.pMin + .5f * bounds.pMax) {}
+    size_t primitiveNumber;
+    Bounds3 bounds;
+    Vector3f centroid;
+    uint8_t type = 0;
+};
+
+// primitive and the Morton code of its centroid, sorted by code for LBVH
+struct MortonPrimitive {
+    int primitiveIndex;
+    uint64_t mortonCode;
+};
+
+// state shared by every thread taking part in one build
+struct BVHAccel::BuildState {
+    std::vector<BVHPrimitiveInfo> primitiveInfo;
+    // partition target, a node only ever touches scratch[start, end) like primitiveInfo
+    std::vector<BVHPrimitiveInfo> scratch;
+    std::vector<int> orderedPrimIndices;
+    std::atomic<int> orderedPrimsOffset{ 0 };
+    std::atomic<int> totalNodes{ 0 };
+    std::atomic<int> activeThreads{ 1 };
+    int maxThreads = 1;
+    // threads a chunked loop may use: once subtrees are forked they already keep maxThreads
+    // busy, so the loops inside them run inline instead of starting maxThreads threads each
+    int loopThreads() const { return activeThreads.load() > 1 ? 1 : maxThreads; }
+};
+
+// ranges with at least this many primitives compute bounds, bins and partitions on several threads
+constexpr int kParallelChunkThreshold = 64 * 1024;
+// subtrees with at least this many primitives are built on their own thread
+constexpr int kParallelForkThreshold = 4 * 1024;
+
+static int numChunks(int n, int maxChunks) {
+    if (n < kParallelChunkThreshold)
+        return 1;
+    return std::max(1, std::min(maxChunks, n / (kParallelChunkThreshold / 4)));
+}
+
+// bounds of chunk c when [start, end) is cut into nChunks nearly equal pieces
+static void chunkRange(int start, int end, int c, int nChunks, int& s, int& e) {
+    s = start + int((long long)(end - start) * c / nChunks);
+    e = start + int((long long)(end - start) * (c + 1) / nChunks);
+}
+
+// run body(chunk, begin, end) for every chunk, one thread each; a single chunk runs inline
+template <typename Body>
+static void parallelFor(int start, int end, int nChunks, Body body) {
+    if (nChunks == 1) {
+        body(0, start, end);
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (int c = 0; c < nChunks; c++) {
+        int s, e;
+        chunkRange(start, end, c, nChunks, s, e);
+        threads.emplace_back(body, c, s, e);
+    }
+    for (auto& t : threads)
+        t.join();
+}
+
+// combine(body(begin, end)) over chunks of [start, end), threaded only for large ranges
+template <typename T, typename Body, typename Combine>
+static T parallelReduce(int start, int end, int maxChunks, const T& identity, Body body, Combine combine) {
+    int nChunks = numChunks(end - start, maxChunks);
+    if (nChunks == 1)
+        return body(start, end);
+    std::vector<T> partial(nChunks, identity);
+    parallelFor(start, end, nChunks, [&](int c, int s, int e) { partial[c] = body(s, e); });
+    T result = identity;
+    for (const T& p : partial)
+        result = combine(result, p);
+    return result;
+}
+
+BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode, SplitMethod splitMethod, NodeLayout layout)
+    : maxPrimsInNode(std::max(1, std::min(255, maxPrimsInNode))), splitMethod(splitMethod), layout(layout),
     primitives(std::move(p)) {
-    time_t start, stop;
-    time(&start);
-    if (primitives.empty())
+    std::vector<Bounds3> primBounds(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i)
+        primBounds[i] = primitives[i]->getBounds();
+    build(primBounds, {});
+
+    std::vector<Object*> orderedPrims(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i)
+        orderedPrims[i] = primitives[primOrder[i]];
+    primitives.swap(orderedPrims);
+
+    float areaSum = 0;
+    areaCdf.reserve(primitives.size());
+    for (auto prim : primitives) {
+        areaSum += prim->getArea();
+        areaCdf.push_back(areaSum);
+    }
+}
+
+BVHAccel::BVHAccel(const std::vector<Bounds3>& primBounds, int maxPrimsInNode, SplitMethod splitMethod,
+    NodeLayout layout, const std::vector<uint8_t>& primTypes)
+    : maxPrimsInNode(std::max(1, std::min(255, maxPrimsInNode))), splitMethod(splitMethod), layout(layout) {
+    build(primBounds, primTypes);
+}
+
+// does [begin, end) hold primitives of more than one type?
+template <typename TypeOf>
+static bool mixedTypes(int begin, int end, TypeOf typeOf) {
+    for (int i = begin + 1; i < end; ++i)
+        if (typeOf(i) != typeOf(begin))
+            return true;
+    return false;
+}
+
+void BVHAccel::build(const std::vector<Bounds3>& primBounds, const std::vector<uint8_t>& primTypes) {
+    auto start = std::chrono::steady_clock::now();
+    if (primBounds.empty())
         return;
 
-    root = recursiveBuild(primitives);
+    BuildState state;
+    state.maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    int nPrims = (int)primBounds.size();
+    state.primitiveInfo.resize(nPrims);
+    state.scratch.resize(nPrims);
+    state.orderedPrimIndices.resize(nPrims);
+    parallelFor(0, nPrims, numChunks(nPrims, state.maxThreads), [&](int, int s, int e) {
+        for (int i = s; i < e; ++i) {
+            state.primitiveInfo[i] = BVHPrimitiveInfo(i, primBounds[i]);
+            if (!primTypes.empty())
+                state.primitiveInfo[i].type = primTypes[i];
+        }
+    });
+
+    // leaves claim contiguous ranges of the primitive order, so every leaf references a single span
+    BVHBuildNode* root;
+    if (splitMethod == SplitMethod::LBVH || splitMethod == SplitMethod::HLBVH)
+        root = HLBVHBuild(state);
+    else
+        root = recursiveBuild(state, 0, nPrims);
+    primOrder.swap(state.orderedPrimIndices);
+
+    // lay the tree out depth-first in one array and drop the pointer-based build nodes
+    nodes.reserve(state.totalNodes.load());
+    flattenBVHTree(root);
+    freeBuildTree(root);
 
-    time(&stop);
-    double diff = difftime(stop, start);
-    int hrs = (int)diff / 3600;
-    int mins = ((int)diff / 60) - (hrs * 60);
-    int secs = (int)diff - (hrs * 3600) - (mins * 60);
+    // wide layouts replace the binary nodes they were collapsed from
+    if (layout == NodeLayout::BVH4)
+        collapseBVH(wideNodes4, 0);
+    else if (layout == NodeLayout::BVH8)
+        collapseBVH(wideNodes8, 0);
+    if (layout != NodeLayout::BINARY)
+        std::vector<LinearBVHNode>().swap(nodes);
 
-    printf("[%x]BVH Generation complete: \nTime Taken: %i hrs, %i mins, %i secs\n\n", &p, hrs, mins, secs);
+    auto stop = std::chrono::steady_clock::now();
+    int nNodes = layout == NodeLayout::BVH4 ? (int)wideNodes4.size() :
+        layout == NodeLayout::BVH8 ? (int)wideNodes8.size() : (int)nodes.size();
+    printf("BVH Generation complete: %d primitives, %d nodes\nTime Taken: %.3f ms\n\n", nPrims,
+        nNodes, std::chrono::duration<double, std::milli>(stop - start).count());
 }
 
-BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects) {
+BVHBuildNode* BVHAccel::recursiveBuild(BuildState& state, int start, int end) {
     BVHBuildNode* node = new BVHBuildNode();
+    state.totalNodes++;
+    std::vector<BVHPrimitiveInfo>& primitiveInfo = state.primitiveInfo;
+    int nPrimitives = end - start;
 
-    // Compute bounds of all primitives in BVH node
-    Bounds3 bounds;
-    for (int i = 0; i < objects.size(); ++i)
-        bounds = Union(bounds, objects[i]->getBounds());
-    if (objects.size() == 1) {
+    // Compute bounds of all primitives and of their centroids in BVH node
+    using BoundsPair = std::pair<Bounds3, Bounds3>;
+    BoundsPair nodeBounds = parallelReduce(start, end, state.loopThreads(), BoundsPair(),
+        [&](int s, int e) {
+            BoundsPair b;
+            for (int i = s; i < e; ++i) {
+                b.first = Union(b.first, primitiveInfo[i].bounds);
+                b.second = Union(b.second, primitiveInfo[i].centroid);
+            }
+            return b;
+        },
+        [](const BoundsPair& a, const BoundsPair& b) {
+            return BoundsPair(Union(a.first, b.first), Union(a.second, b.second));
+        });
+    const Bounds3& bounds = nodeBounds.first;
+    const Bounds3& centroidBounds = nodeBounds.second;
+
+    auto createLeaf = [&]() {
         // Create leaf _BVHBuildNode_
-        node->bounds = objects[0]->getBounds();
-        node->object = objects[0];
+        node->bounds = bounds;
         node->left = nullptr;
         node->right = nullptr;
-        node->area = objects[0]->getArea();
+        node->firstPrimOffset = state.orderedPrimsOffset.fetch_add(nPrimitives);
+        node->nPrimitives = nPrimitives;
+        node->primType = primitiveInfo[start].type;
+        for (int i = start; i < end; ++i)
+            state.orderedPrimIndices[node->firstPrimOffset + i - start] = (int)primitiveInfo[i].primitiveNumber;
         return node;
-    } else if (objects.size() == 2) {
-        node->left = recursiveBuild(std::vector{ objects[0] });
-        node->right = recursiveBuild(std::vector{ objects[1] });
+    };
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
-        return node;
-    } else {
-        Bounds3 centroidBounds;
-        for (int i = 0; i < objects.size(); ++i)
-            centroidBounds =
-            Union(centroidBounds, objects[i]->getBounds().Centroid());
-        int dim = centroidBounds.maxExtent();
-        switch (dim) {
-        case 0:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().x <
-                    f2->getBounds().Centroid().x;
-                });
-            break;
-        case 1:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().y <
-                    f2->getBounds().Centroid().y;
-                });
-            break;
-        case 2:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().z <
-                    f2->getBounds().Centroid().z;
+    if (nPrimitives == 1)
+        return createLeaf();
+
+    int dim = centroidBounds.maxExtent();
+    node->splitAxis = dim;
+    int mid = (start + end) / 2;
+
+    if (nPrimitives <= maxPrimsInNode &&
+        mixedTypes(start, end, [&](int i) { return primitiveInfo[i].type; })) {
+        // small enough for a leaf, but leaves hold a single primitive type: split by type first
+        uint8_t firstType = primitiveInfo[start].type;
+        mid = partitionPrimitives(state, start, end, [firstType](const BVHPrimitiveInfo& pi) {
+            return pi.type == firstType;
+        });
+    } else if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
+        // all centroids coincide, no split can separate them
+        if (nPrimitives <= maxPrimsInNode)
+            return createLeaf();
+    } else if (splitMethod == SplitMethod::SAH && nPrimitives > 2) {
+        // Partition primitives using approximate SAH over equally sized buckets
+        constexpr int nBuckets = 16;
+        struct BucketInfo {
+            int count = 0;
+            Bounds3 bounds;
+        };
+        auto bucketIndex = [&](const BVHPrimitiveInfo& pi) {
+            int k = nBuckets * centroidBounds.Offset(pi.centroid)[dim];
+            return std::min(k, nBuckets - 1);
+        };
+        using Buckets = std::array<BucketInfo, nBuckets>;
+        Buckets buckets = parallelReduce(start, end, state.loopThreads(), Buckets(),
+            [&](int s, int e) {
+                Buckets b;
+                for (int i = s; i < e; ++i) {
+                    BucketInfo& bucket = b[bucketIndex(primitiveInfo[i])];
+                    bucket.count++;
+                    bucket.bounds = Union(bucket.bounds, primitiveInfo[i].bounds);
+                }
+                return b;
+            },
+            [](const Buckets& a, const Buckets& b) {
+                Buckets sum;
+                for (int k = 0; k < nBuckets; ++k) {
+                    sum[k].count = a[k].count + b[k].count;
+                    sum[k].bounds = Union(a[k].bounds, b[k].bounds);
+                }
+                return sum;
+            });
+
+        // Compute costs for splitting after each bucket, sweeping once from each side
+        float cost[nBuckets - 1];
+        Bounds3 b0;
+        int count0 = 0;
+        for (int k = 0; k < nBuckets - 1; ++k) {
+            b0 = Union(b0, buckets[k].bounds);
+            count0 += buckets[k].count;
+            cost[k] = count0 * (count0 ? b0.SurfaceArea() : 0);
+        }
+        Bounds3 b1;
+        int count1 = 0;
+        for (int k = nBuckets - 1; k > 0; --k) {
+            b1 = Union(b1, buckets[k].bounds);
+            count1 += buckets[k].count;
+            cost[k - 1] += count1 * (count1 ? b1.SurfaceArea() : 0);
+        }
+
+        // Find bucket to split at that minimizes SAH metric, relative to intersecting one primitive
+        int minCostSplitBucket = 0;
+        for (int k = 1; k < nBuckets - 1; ++k)
+            if (cost[k] < cost[minCostSplitBucket])
+                minCostSplitBucket = k;
+        float minCost = 0.125f + cost[minCostSplitBucket] / bounds.SurfaceArea();
+
+        // Either create leaf or split primitives at selected SAH bucket; leaves may hold up
+        // to maxPrimsInNode primitives, SAH decides whether splitting further pays off
+        float leafCost = nPrimitives;
+        if (nPrimitives <= maxPrimsInNode && minCost >= leafCost)
+            return createLeaf();
+        int split = partitionPrimitives(state, start, end, [&](const BVHPrimitiveInfo& pi) {
+            return bucketIndex(pi) <= minCostSplitBucket;
+        });
+        if (split > start && split < end)
+            mid = split;
+        else
+            std::nth_element(primitiveInfo.begin() + start, primitiveInfo.begin() + mid, primitiveInfo.begin() + end,
+                [dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+                    return a.centroid[dim] < b.centroid[dim];
                 });
-            break;
+    } else {
+        if (nPrimitives <= maxPrimsInNode)
+            return createLeaf();
+        // Partition primitives into equally sized subsets
+        std::nth_element(primitiveInfo.begin() + start, primitiveInfo.begin() + mid, primitiveInfo.begin() + end,
+            [dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+                return a.centroid[dim] < b.centroid[dim];
+            });
+    }
+
+    // large subtrees go to their own thread while this one continues with the right child
+    bool fork = false;
+    if (nPrimitives >= kParallelForkThreshold) {
+        fork = state.activeThreads.fetch_add(1) < state.maxThreads;
+        if (!fork)
+            state.activeThreads--;
+    }
+    if (fork) {
+        auto left = std::async(std::launch::async, [&state, this, start, mid]() {
+            BVHBuildNode* child = recursiveBuild(state, start, mid);
+            state.activeThreads--;
+            return child;
+        });
+        node->right = recursiveBuild(state, mid, end);
+        node->left = left.get();
+    } else {
+        node->left = recursiveBuild(state, start, mid);
+        node->right = recursiveBuild(state, mid, end);
+    }
+
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+
+    return node;
+}
+
+template <typename Predicate>
+int BVHAccel::partitionPrimitives(BuildState& state, int start, int end, Predicate pred) {
+    std::vector<BVHPrimitiveInfo>& info = state.primitiveInfo;
+    if (end - start < kParallelChunkThreshold)
+        return int(std::partition(info.begin() + start, info.begin() + end, pred) - info.begin());
+
+    // count, prefix sum, then scatter each chunk into its slots of scratch and copy back
+    int nChunks = numChunks(end - start, state.loopThreads());
+    std::vector<int> leftCount(nChunks), leftOffset(nChunks), rightOffset(nChunks);
+    parallelFor(start, end, nChunks, [&](int c, int s, int e) {
+        int n = 0;
+        for (int i = s; i < e; ++i)
+            n += pred(info[i]);
+        leftCount[c] = n;
+    });
+    int nLeft = 0;
+    for (int c = 0; c < nChunks; ++c) {
+        leftOffset[c] = start + nLeft;
+        nLeft += leftCount[c];
+    }
+    int rightStart = start + nLeft;
+    for (int c = 0; c < nChunks; ++c) {
+        int s, e;
+        chunkRange(start, end, c, nChunks, s, e);
+        rightOffset[c] = rightStart;
+        rightStart += (e - s) - leftCount[c];
+    }
+    parallelFor(start, end, nChunks, [&](int c, int s, int e) {
+        int l = leftOffset[c], r = rightOffset[c];
+        for (int i = s; i < e; ++i)
+            state.scratch[pred(info[i]) ? l++ : r++] = info[i];
+    });
+    parallelFor(start, end, nChunks, [&](int, int s, int e) {
+        std::copy(state.scratch.begin() + s, state.scratch.begin() + e, info.begin() + s);
+    });
+    return start + nLeft;
+}
+
+BVHAccel::~BVHAccel() = default;
+
+// spread the low 21 bits of x so that two zero bits separate each of them
+static inline uint64_t LeftShift3(uint64_t x) {
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffff;
+    x = (x | x << 16) & 0x1f0000ff0000ff;
+    x = (x | x << 8) & 0x100f00f00f00f00f;
+    x = (x | x << 4) & 0x10c30c30c30c30c3;
+    x = (x | x << 2) & 0x1249249249249249;
+    return x;
+}
+
+// v in [0, 2^bitsPerAxis)^3, x lands on bits 0, 3, 6.. so bit b splits along axis b % 3
+static inline uint64_t EncodeMorton3(const Vector3f& v) {
+    return (LeftShift3((uint64_t)v.z) << 2) | (LeftShift3((uint64_t)v.y) << 1) | LeftShift3((uint64_t)v.x);
+}
+
+// LSD radix sort on the low nBits of the Morton codes, bitsPerPass bits at a time
+static void RadixSort(std::vector<MortonPrimitive>* v, int nBits) {
+    std::vector<MortonPrimitive> tempVector(v->size());
+    constexpr int bitsPerPass = 6;
+    constexpr int nBuckets = 1 << bitsPerPass;
+    constexpr uint64_t bitMask = (1 << bitsPerPass) - 1;
+    int nPasses = (nBits + bitsPerPass - 1) / bitsPerPass;
+    for (int pass = 0; pass < nPasses; ++pass) {
+        // Perform one pass of radix sort, sorting bitsPerPass bits
+        int lowBit = pass * bitsPerPass;
+        std::vector<MortonPrimitive>& in = (pass & 1) ? tempVector : *v;
+        std::vector<MortonPrimitive>& out = (pass & 1) ? *v : tempVector;
+
+        // Count number of zero bits in array for current radix sort bit
+        int bucketCount[nBuckets] = { 0 };
+        for (const MortonPrimitive& mp : in)
+            bucketCount[(mp.mortonCode >> lowBit) & bitMask]++;
+
+        // Compute starting index in output array for each bucket
+        int outIndex[nBuckets];
+        outIndex[0] = 0;
+        for (int i = 1; i < nBuckets; ++i)
+            outIndex[i] = outIndex[i - 1] + bucketCount[i - 1];
+
+        // Store sorted values in output array
+        for (const MortonPrimitive& mp : in)
+            out[outIndex[(mp.mortonCode >> lowBit) & bitMask]++] = mp;
+    }
+    // Copy final result from tempVector, if needed
+    if (nPasses & 1)
+        std::swap(*v, tempVector);
+}
+
+BVHBuildNode* BVHAccel::HLBVHBuild(BuildState& state) {
+    std::vector<BVHPrimitiveInfo>& primitiveInfo = state.primitiveInfo;
+    int nPrims = (int)primitiveInfo.size();
+    Bounds3 centroidBounds = parallelReduce(0, nPrims, state.maxThreads, Bounds3(),
+        [&](int s, int e) {
+            Bounds3 b;
+            for (int i = s; i < e; ++i)
+                b = Union(b, primitiveInfo[i].centroid);
+            return b;
+        },
+        [](const Bounds3& a, const Bounds3& b) { return Union(a, b); });
+
+    // 30 bit codes sort in 5 passes, very large inputs get 63 bits so fewer primitives share a cell
+    int bitsPerAxis = nPrims > (1 << 20) ? 21 : 10;
+    int mortonBits = 3 * bitsPerAxis;
+    std::vector<MortonPrimitive> mortonPrims(nPrims);
+    parallelFor(0, nPrims, numChunks(nPrims, state.maxThreads), [&](int, int s, int e) {
+        float mortonScale = (float)((1 << bitsPerAxis) - 1);
+        for (int i = s; i < e; ++i) {
+            mortonPrims[i].primitiveIndex = i;
+            Vector3f centroidOffset = centroidBounds.Offset(primitiveInfo[i].centroid);
+            mortonPrims[i].mortonCode = EncodeMorton3(centroidOffset * mortonScale);
         }
+    });
+    RadixSort(&mortonPrims, mortonBits);
 
-        auto beginning = objects.begin();
-        auto middling = objects.begin() + (objects.size() / 2);
-        auto ending = objects.end();
+    if (splitMethod == SplitMethod::LBVH)
+        return emitLBVH(state, mortonPrims.data(), nPrims, mortonBits - 1);
 
-        auto leftshapes = std::vector<Object*>(beginning, middling);
-        auto rightshapes = std::vector<Object*>(middling, ending);
+    // Create LBVH treelets at bottom of BVH, one per cell of the coarse 2^12 grid
+    struct LBVHTreelet {
+        int startIndex, nPrimitives;
+        BVHBuildNode* root;
+    };
+    int treeletBits = 12;
+    uint64_t treeletMask = ((1ull << treeletBits) - 1) << (mortonBits - treeletBits);
+    std::vector<LBVHTreelet> treeletsToBuild;
+    for (int start = 0, end = 1; end <= nPrims; ++end) {
+        if (end == nPrims ||
+            ((mortonPrims[start].mortonCode & treeletMask) != (mortonPrims[end].mortonCode & treeletMask))) {
+            treeletsToBuild.push_back({ start, end - start, nullptr });
+            start = end;
+        }
+    }
 
-        assert(objects.size() == (leftshapes.size() + rightshapes.size()));
+    // Create LBVHs for treelets in parallel
+    int nTreelets = (int)treeletsToBuild.size();
+    int nChunks = nPrims >= kParallelChunkThreshold ? std::min(state.maxThreads, nTreelets) : 1;
+    parallelFor(0, nTreelets, nChunks, [&](int, int s, int e) {
+        for (int i = s; i < e; ++i) {
+            LBVHTreelet& tr = treeletsToBuild[i];
+            tr.root = emitLBVH(state, &mortonPrims[tr.startIndex], tr.nPrimitives, mortonBits - treeletBits - 1);
+        }
+    });
 
-        node->left = recursiveBuild(leftshapes);
-        node->right = recursiveBuild(rightshapes);
+    // Create and return SAH BVH from LBVH treelets
+    std::vector<BVHBuildNode*> finishedTreelets;
+    finishedTreelets.reserve(nTreelets);
+    for (LBVHTreelet& treelet : treeletsToBuild)
+        finishedTreelets.push_back(treelet.root);
+    int upperNodes = 0;
+    BVHBuildNode* root = buildUpperSAH(finishedTreelets, 0, nTreelets, &upperNodes);
+    state.totalNodes += upperNodes;
+    return root;
+}
 
+BVHBuildNode* BVHAccel::emitLBVH(BuildState& state, const MortonPrimitive* mortonPrims, int nPrimitives, int bitIndex) {
+    auto typeOf = [&](int i) { return state.primitiveInfo[mortonPrims[i].primitiveIndex].type; };
+    if ((bitIndex == -1 || nPrimitives <= maxPrimsInNode) && mixedTypes(0, nPrimitives, typeOf)) {
+        // leaves hold a single primitive type: one leaf for the first type, the rest split further
+        std::vector<MortonPrimitive> byType(mortonPrims, mortonPrims + nPrimitives);
+        uint8_t firstType = typeOf(0);
+        int nFirst = int(std::stable_partition(byType.begin(), byType.end(), [&](const MortonPrimitive& mp) {
+            return state.primitiveInfo[mp.primitiveIndex].type == firstType;
+        }) - byType.begin());
+        state.totalNodes++;
+        BVHBuildNode* node = new BVHBuildNode();
+        node->left = emitLBVH(state, byType.data(), nFirst, -1);
+        node->right = emitLBVH(state, byType.data() + nFirst, nPrimitives - nFirst, -1);
         node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
+        return node;
+    }
+    if (nPrimitives <= maxPrimsInNode) {
+        // Create and return leaf node of LBVH treelet
+        state.totalNodes++;
+        BVHBuildNode* node = new BVHBuildNode();
+        node->firstPrimOffset = state.orderedPrimsOffset.fetch_add(nPrimitives);
+        node->nPrimitives = nPrimitives;
+        node->primType = typeOf(0);
+        for (int i = 0; i < nPrimitives; ++i) {
+            const BVHPrimitiveInfo& info = state.primitiveInfo[mortonPrims[i].primitiveIndex];
+            state.orderedPrimIndices[node->firstPrimOffset + i] = (int)info.primitiveNumber;
+            node->bounds = Union(node->bounds, info.bounds);
+        }
+        return node;
     }
+    if (bitIndex == -1) {
+        // out of Morton bits with more than maxPrimsInNode primitives (identical codes): split
+        // the run in the middle until the leaves are small enough
+        int mid = nPrimitives / 2;
+        state.totalNodes++;
+        BVHBuildNode* node = new BVHBuildNode();
+        node->left = emitLBVH(state, mortonPrims, mid, -1);
+        node->right = emitLBVH(state, &mortonPrims[mid], nPrimitives - mid, -1);
+        node->bounds = Union(node->left->bounds, node->right->bounds);
+        return node;
+    }
+
+    uint64_t mask = 1ull << bitIndex;
+    // Advance to next subtree level if there's no LBVH split for this bit
+    if ((mortonPrims[0].mortonCode & mask) == (mortonPrims[nPrimitives - 1].mortonCode & mask))
+        return emitLBVH(state, mortonPrims, nPrimitives, bitIndex - 1);
 
+    // Find LBVH split point for this dimension
+    int searchStart = 0, searchEnd = nPrimitives - 1;
+    while (searchStart + 1 != searchEnd) {
+        int mid = (searchStart + searchEnd) / 2;
+        if ((mortonPrims[searchStart].mortonCode & mask) == (mortonPrims[mid].mortonCode & mask))
+            searchStart = mid;
+        else
+            searchEnd = mid;
+    }
+    int splitOffset = searchEnd;
+
+    // Create and return interior LBVH node
+    state.totalNodes++;
+    BVHBuildNode* node = new BVHBuildNode();
+    node->splitAxis = bitIndex % 3;
+    node->left = emitLBVH(state, mortonPrims, splitOffset, bitIndex - 1);
+    node->right = emitLBVH(state, &mortonPrims[splitOffset], nPrimitives - splitOffset, bitIndex - 1);
+    node->bounds = Union(node->left->bounds, node->right->bounds);
     return node;
 }
 
-Intersection BVHAccel::Intersect(const Ray& ray) const {
-    Intersection isect;
-    if (!root)
-        return isect;
-    isect = BVHAccel::getIntersection(root, ray);
-    return isect;
-}
-
-Intersection BVHAccel::getIntersection(BVHBuildNode* node,
-    const Ray& ray) const {
-    // TODO Traverse the BVH to find intersection
-    std::array<int, 3> dirisNeg = { int(ray.direction.x > 0),int(ray.direction.y > 0),int(ray.direction.z > 0) };
-    Intersection inter;
-    if (node->bounds.IntersectP(ray, Vector3f(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z), dirisNeg) == false)
-        return Intersection();
-    if (node->left == nullptr && node->right == nullptr)
-        return node->object->getIntersection(ray);
-    Intersection hit_left = getIntersection(node->left, ray);
-    Intersection hit_right = getIntersection(node->right, ray);
-    return (hit_left.distance < hit_right.distance) ? hit_left : hit_right;
-}
-
-void BVHAccel::getSample(BVHBuildNode* node, float p, Intersection& pos,
-    float& pdf) {
-    if (node->left == nullptr || node->right == nullptr) {
-        node->object->Sample(pos, pdf);
-        pdf *= node->area;
+BVHBuildNode* BVHAccel::buildUpperSAH(std::vector<BVHBuildNode*>& treeletRoots, int start, int end, int* totalNodes) {
+    int nNodes = end - start;
+    if (nNodes == 1)
+        return treeletRoots[start];
+    (*totalNodes)++;
+    BVHBuildNode* node = new BVHBuildNode();
+
+    // Compute bounds of all nodes under this HLBVH node
+    Bounds3 bounds, centroidBounds;
+    for (int i = start; i < end; ++i) {
+        bounds = Union(bounds, treeletRoots[i]->bounds);
+        centroidBounds = Union(centroidBounds, treeletRoots[i]->bounds.Centroid());
+    }
+    int dim = centroidBounds.maxExtent();
+    node->splitAxis = dim;
+    int mid = (start + end) / 2;
+
+    if (centroidBounds.pMax[dim] != centroidBounds.pMin[dim]) {
+        // Initialize BucketInfo for HLBVH SAH partition buckets
+        constexpr int nBuckets = 12;
+        struct BucketInfo {
+            int count = 0;
+            Bounds3 bounds;
+        };
+        BucketInfo buckets[nBuckets];
+        auto bucketIndex = [&](BVHBuildNode* n) {
+            int b = nBuckets * centroidBounds.Offset(n->bounds.Centroid())[dim];
+            return std::min(b, nBuckets - 1);
+        };
+        for (int i = start; i < end; ++i) {
+            BucketInfo& bucket = buckets[bucketIndex(treeletRoots[i])];
+            bucket.count++;
+            bucket.bounds = Union(bucket.bounds, treeletRoots[i]->bounds);
+        }
+
+        // Compute costs for splitting after each bucket
+        float cost[nBuckets - 1];
+        for (int i = 0; i < nBuckets - 1; ++i) {
+            Bounds3 b0, b1;
+            int count0 = 0, count1 = 0;
+            for (int j = 0; j <= i; ++j) {
+                b0 = Union(b0, buckets[j].bounds);
+                count0 += buckets[j].count;
+            }
+            for (int j = i + 1; j < nBuckets; ++j) {
+                b1 = Union(b1, buckets[j].bounds);
+                count1 += buckets[j].count;
+            }
+            cost[i] = .125f + (count0 * (count0 ? b0.SurfaceArea() : 0) +
+                count1 * (count1 ? b1.SurfaceArea() : 0)) / bounds.SurfaceArea();
+        }
+
+        // Find bucket to split at that minimizes SAH metric
+        int minCostSplitBucket = 0;
+        for (int i = 1; i < nBuckets - 1; ++i)
+            if (cost[i] < cost[minCostSplitBucket])
+                minCostSplitBucket = i;
+
+        // Split nodes and create interior HLBVH SAH node
+        auto pmid = std::partition(treeletRoots.begin() + start, treeletRoots.begin() + end,
+            [&](BVHBuildNode* n) { return bucketIndex(n) <= minCostSplitBucket; });
+        int split = int(pmid - treeletRoots.begin());
+        if (split > start && split < end)
+            mid = split;
+    }
+
+    node->left = buildUpperSAH(treeletRoots, start, mid, totalNodes);
+    node->right = buildUpperSAH(treeletRoots, mid, end, totalNodes);
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+    return node;
+}
+
+int BVHAccel::flattenBVHTree(BVHBuildNode* node) {
+    int myOffset = (int)nodes.size();
+    nodes.emplace_back();
+    nodes[myOffset].bounds = node->bounds;
+    if (node->nPrimitives > 0) {
+        nodes[myOffset].primitivesOffset = node->firstPrimOffset;
+        nodes[myOffset].nPrimitives = node->nPrimitives;
+        nodes[myOffset].primType = node->primType;
+    } else {
+        // Create interior flattened BVH node
+        nodes[myOffset].axis = node->splitAxis;
+        nodes[myOffset].nPrimitives = 0;
+        flattenBVHTree(node->left);
+        int secondChildOffset = flattenBVHTree(node->right);
+        nodes[myOffset].secondChildOffset = secondChildOffset;
+    }
+    return myOffset;
+}
+
+void BVHAccel::freeBuildTree(BVHBuildNode* node) {
+    if (node == nullptr)
         return;
+    freeBuildTree(node->left);
+    freeBuildTree(node->right);
+    delete node;
+}
+
+template <int N>
+int BVHAccel::collapseBVH(std::vector<WideBVHNode<N>>& wideNodes, int nodeIndex) const {
+    // Gather up to N descendants by repeatedly opening the interior child with the largest surface area
+    int children[N];
+    int nChildren = 0;
+    if (nodes[nodeIndex].nPrimitives > 0) {
+        children[nChildren++] = nodeIndex;
+    } else {
+        children[nChildren++] = nodeIndex + 1;
+        children[nChildren++] = nodes[nodeIndex].secondChildOffset;
     }
-    if (p < node->left->area)
-        getSample(node->left, p, pos, pdf);
-    else
-        getSample(node->right, p - node->left->area, pos, pdf);
+    while (nChildren < N) {
+        int best = -1;
+        double bestArea = 0;
+        for (int i = 0; i < nChildren; ++i) {
+            const LinearBVHNode& c = nodes[children[i]];
+            if (c.nPrimitives == 0 && (best < 0 || c.bounds.SurfaceArea() > bestArea)) {
+                best = i;
+                bestArea = c.bounds.SurfaceArea();
+            }
+        }
+        if (best < 0)
+            break;
+        int opened = children[best];
+        children[best] = opened + 1;
+        children[nChildren++] = nodes[opened].secondChildOffset;
+    }
+
+    int myIndex = (int)wideNodes.size();
+    wideNodes.emplace_back();
+    for (int i = 0; i < nChildren; ++i) {
+        const LinearBVHNode& c = nodes[children[i]];
+        if (c.nPrimitives > 0) {
+            wideNodes[myIndex].setChild(i, c.bounds, c.primitivesOffset, c.nPrimitives, c.primType);
+        } else {
+            int childIndex = collapseBVH(wideNodes, children[i]);
+            wideNodes[myIndex].setChild(i, c.bounds, childIndex, 0);
+        }
+    }
+    return myIndex;
+}
+
+Intersection BVHAccel::Intersect(const Ray& ray) const {
+    HitRecord hit(ray.t_max);
+    if (!Intersect(ray, hit))
+        return Intersection();
+    return primitives[hit.instId]->finalize(ray, hit);
 }
 
-void BVHAccel::Sample(Intersection& pos, float& pdf) {
-    float p = std::sqrt(get_random_float()) * root->area;
-    getSample(root, p, pos, pdf);
-    pdf /= root->area;
-}
\ No newline at end of file
+bool BVHAccel::Intersect(const Ray& ray, HitRecord& hit) const {
+    bool found = false;
+    traverse(ray, hit.t, [&](int first, int count, int, float& tMax) {
+        for (int i = first; i < first + count; ++i) {
+            if (primitives[i]->intersect(ray, hit)) {
+                hit.instId = i;
+                found = true;
+            }
+        }
+        tMax = hit.t;
+    });
+    return found;
+}
+
+bool BVHAccel::IntersectP(const Ray& ray) const {
+    return traverseAny(ray, [&](int first, int count, int) {
+        for (int i = first; i < first + count; ++i)
+            if (primitives[i]->occluded(ray))
+                return true;
+        return false;
+    });
+}
+
+void BVHAccel::Sample(Intersection& pos, float& pdf, Sampler& sampler) {
+    if (primitives.empty())
+        return;
+    float areaSum = areaCdf.back();
+    float p = sampler.get1D() * areaSum;
+    size_t i = std::min(size_t(std::upper_bound(areaCdf.begin(), areaCdf.end(), p) - areaCdf.begin()),
+        primitives.size() - 1);
+    primitives[i]->Sample(pos, pdf, sampler);
+    // pdf of the point on the primitive times the probability of picking the primitive
+    pdf *= primitives[i]->getArea() / areaSum;
+}
@@ -4,16 +4,82 @@
 #include <atomic>
 #include <vector>
 #include <memory>
-#include <ctime>
 #include "Object.hpp"
 #include "Ray.hpp"
 #include "Bounds3.hpp"
 #include "Intersection.hpp"
 #include "Vector.hpp"
+#include "WideBVH.hpp"
 
 struct BVHBuildNode;
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
+struct MortonPrimitive;
+
+// compact node of the flattened tree, stored in depth-first order so the
+// first child of an interior node always directly follows its parent
+struct LinearBVHNode {
+    Bounds3 bounds;
+    union {
+        int primitivesOffset;  // leaf
+        int secondChildOffset; // interior
+    };
+    uint16_t nPrimitives; // 0 -> interior node
+    uint8_t axis;         // interior node: xyz
+    uint8_t primType;     // leaf: type key shared by all its primitives
+};
+#ifdef RAYTRACING_SIMD_VECTOR
+// padded 16-byte Vector3f bounds grow the node to 48 bytes
+static_assert(sizeof(LinearBVHNode) == 48, "LinearBVHNode should be bounds plus 16 bytes");
+#else
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should fill half a cache line");
+#endif
+
+// most rays traversePacket walks together, so a packet's active set fits a 32-bit mask
+constexpr int kMaxRayPacket = 16;
+
+// ray data of a packet laid out by lane, so one box is slab tested against four rays at a time
+struct RayPacket {
+    alignas(16) float org[3][kMaxRayPacket];
+    alignas(16) float invDir[3][kMaxRayPacket];
+    alignas(16) float tMax[kMaxRayPacket];
+
+    // rays of mask that enter b before their tMax, all rays sharing the direction signs dirIsNeg
+    inline uint32_t intersect(const Bounds3& b, const std::array<int, 3>& dirIsNeg, uint32_t mask) const;
+};
+
+inline uint32_t RayPacket::intersect(const Bounds3& b, const std::array<int, 3>& dirIsNeg, uint32_t mask) const {
+    uint32_t hit = 0;
+    for (int h = 0; h < kMaxRayPacket; h += 4) {
+        if (((mask >> h) & 0xF) == 0)
+            continue;
+#ifdef RAYTRACING_WIDEBVH_SSE
+        __m128 t0 = _mm_setzero_ps();
+        __m128 t1 = _mm_load_ps(&tMax[h]);
+        for (int a = 0; a < 3; a++) {
+            __m128 o = _mm_load_ps(&org[a][h]);
+            __m128 inv = _mm_load_ps(&invDir[a][h]);
+            __m128 tn = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b[dirIsNeg[a]][a]), o), inv);
+            __m128 tf = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b[1 - dirIsNeg[a]][a]), o), inv);
+            t0 = _mm_max_ps(tn, t0);
+            t1 = _mm_min_ps(tf, t1);
+        }
+        hit |= uint32_t(_mm_movemask_ps(_mm_cmple_ps(t0, _mm_mul_ps(t1, _mm_set1_ps(kRobustSlabScale))))) << h;
+#else
+        for (int i = h; i < h + 4; i++) {
+            float t0 = 0, t1 = tMax[i];
+            for (int a = 0; a < 3; a++) {
+                float tn = (b[dirIsNeg[a]][a] - org[a][i]) * invDir[a][i];
+                float tf = (b[1 - dirIsNeg[a]][a] - org[a][i]) * invDir[a][i];
+                t0 = tn > t0 ? tn : t0;
+                t1 = tf < t1 ? tf : t1;
+            }
+            if (t0 <= t1 * kRobustSlabScale) hit |= 1u << i;
+        }
+#endif
+    }
+    return hit & mask;
+}
 
 // BVHAccel Declarations
 inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
@@ -21,47 +87,321 @@ class BVHAccel {
 
 public:
     // BVHAccel Public Types
-    enum class SplitMethod { NAIVE, SAH };
+    // LBVH: Morton-ordered hierarchy emitted in linear time, for fast (re)builds
+    // HLBVH: LBVH treelets joined by an SAH-built top of the tree
+    enum class SplitMethod { NAIVE, SAH, LBVH, HLBVH };
+    // BINARY: LinearBVHNode tree, BVH4/BVH8: the same tree collapsed into 4/8-wide SIMD nodes
+    enum class NodeLayout { BINARY, BVH4, BVH8 };
 
     // BVHAccel Public Methods
-    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE,
+        NodeLayout layout = NodeLayout::BINARY);
+    // hierarchy over bare bounds, for owners that keep their primitives themselves (e.g. a
+    // mesh's index buffer); leaves refer to [first, first + count) of primitiveOrder. With
+    // primTypes, every leaf holds primitives of a single type and reports it to traversal.
+    BVHAccel(const std::vector<Bounds3>& primBounds, int maxPrimsInNode = 1,
+        SplitMethod splitMethod = SplitMethod::NAIVE, NodeLayout layout = NodeLayout::BINARY,
+        const std::vector<uint8_t>& primTypes = {});
     Bounds3 WorldBound() const;
     ~BVHAccel();
 
+    // closest / any hit against the Object primitives (Object constructor only); the hit
+    // record variant leaves the primitive's slot in hit.instId for finalizing it later
     Intersection Intersect(const Ray& ray) const;
-    Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
+    bool Intersect(const Ray& ray, HitRecord& hit) const;
     bool IntersectP(const Ray& ray) const;
-    BVHBuildNode* root;
+
+    // front-to-back walk calling leaf(first, count, type, tMax) for every leaf the ray reaches
+    // before tMax; the callback shrinks tMax when it finds a closer hit so farther subtrees are
+    // culled. type is the leaf's primitive type key (0 when built without primTypes).
+    template <typename LeafFn>
+    void traverse(const Ray& ray, float tMax, LeafFn&& leaf) const;
+    // any-hit walk, stops as soon as leaf(first, count, type) returns true
+    template <typename LeafFn>
+    bool traverseAny(const Ray& ray, LeafFn&& leaf) const;
+    // closest-hit walk of n <= kMaxRayPacket coherent rays (e.g. neighbouring camera rays) in one
+    // pass over the BINARY tree: leaf(first, count, type, mask) gets the rays of mask whose own
+    // slab test reached the leaf and lowers their tMax[i]. Returns false without visiting
+    // anything if the rays do not share direction signs or the layout is wide; the caller then
+    // traces them one by one.
+    template <typename LeafFn>
+    bool traversePacket(const Ray* rays, int n, float* tMax, LeafFn&& leaf) const;
+
+    // original index of the primitive stored at every leaf slot
+    const std::vector<int>& primitiveOrder() const { return primOrder; }
 
     // BVHAccel Private Methods
-    BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+    struct BuildState;
+    void build(const std::vector<Bounds3>& primBounds, const std::vector<uint8_t>& primTypes);
+    BVHBuildNode* recursiveBuild(BuildState& state, int start, int end);
+    template <typename Predicate>
+    int partitionPrimitives(BuildState& state, int start, int end, Predicate pred);
+    BVHBuildNode* HLBVHBuild(BuildState& state);
+    BVHBuildNode* emitLBVH(BuildState& state, const MortonPrimitive* mortonPrims, int nPrimitives, int bitIndex);
+    BVHBuildNode* buildUpperSAH(std::vector<BVHBuildNode*>& treeletRoots, int start, int end, int* totalNodes);
+    int flattenBVHTree(BVHBuildNode* node);
+    void freeBuildTree(BVHBuildNode* node);
+    template <int N>
+    int collapseBVH(std::vector<WideBVHNode<N>>& wideNodes, int nodeIndex) const;
+    template <int N, typename LeafFn>
+    void traverseWide(const std::vector<WideBVHNode<N>>& wideNodes, const Ray& ray, float tMax, LeafFn& leaf) const;
+    template <int N, typename LeafFn>
+    bool traverseAnyWide(const std::vector<WideBVHNode<N>>& wideNodes, const Ray& ray, LeafFn& leaf) const;
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
+    const NodeLayout layout;
     std::vector<Object*> primitives;
+    std::vector<int> primOrder;
+    std::vector<LinearBVHNode> nodes;
+    std::vector<WideBVHNode<4>> wideNodes4;
+    std::vector<WideBVHNode<8>> wideNodes8;
+    // running sum of primitive areas in primitives' order, used to pick a primitive proportional to its area
+    std::vector<float> areaCdf;
 
-    void getSample(BVHBuildNode* node, float p, Intersection& pos, float& pdf);
-    void Sample(Intersection& pos, float& pdf);
+    void Sample(Intersection& pos, float& pdf, Sampler& sampler);
 };
 
 struct BVHBuildNode {
     Bounds3 bounds;
     BVHBuildNode* left;
     BVHBuildNode* right;
-    Object* object;
-    float area;
 
 public:
     int splitAxis = 0, firstPrimOffset = 0, nPrimitives = 0;
+    uint8_t primType = 0;
     // BVHBuildNode Public Methods
     BVHBuildNode() {
         bounds = Bounds3();
         left = nullptr; right = nullptr;
-        object = nullptr;
     }
 };
 
+template <typename LeafFn>
+void BVHAccel::traverse(const Ray& ray, float tMax, LeafFn&& leaf) const {
+    if (layout == NodeLayout::BVH4)
+        return traverseWide(wideNodes4, ray, tMax, leaf);
+    if (layout == NodeLayout::BVH8)
+        return traverseWide(wideNodes8, ray, tMax, leaf);
+    if (nodes.empty())
+        return;
+    const Vector3f& invDir = ray.direction_inv;
+    std::array<int, 3> dirIsNeg = { int(invDir.x < 0), int(invDir.y < 0), int(invDir.z < 0) };
+
+    // Follow ray through BVH nodes to find primitive intersections
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    int nodesToVisit[64];
+    while (true) {
+        const LinearBVHNode* node = &nodes[currentNodeIndex];
+        if (node->bounds.IntersectP(ray, invDir, dirIsNeg, tMax)) {
+            if (node->nPrimitives > 0) {
+                leaf(node->primitivesOffset, (int)node->nPrimitives, (int)node->primType, tMax);
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            } else {
+                // Put far BVH node on nodesToVisit stack, advance to near node
+                if (dirIsNeg[node->axis]) {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node->secondChildOffset;
+                } else {
+                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+            }
+        } else {
+            if (toVisitOffset == 0) break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+}
+
+template <typename LeafFn>
+bool BVHAccel::traverseAny(const Ray& ray, LeafFn&& leaf) const {
+    if (layout == NodeLayout::BVH4)
+        return traverseAnyWide(wideNodes4, ray, leaf);
+    if (layout == NodeLayout::BVH8)
+        return traverseAnyWide(wideNodes8, ray, leaf);
+    if (nodes.empty())
+        return false;
+    const Vector3f& invDir = ray.direction_inv;
+    std::array<int, 3> dirIsNeg = { int(invDir.x < 0), int(invDir.y < 0), int(invDir.z < 0) };
+    float tMax = ray.t_max;
+
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    int nodesToVisit[64];
+    while (true) {
+        const LinearBVHNode* node = &nodes[currentNodeIndex];
+        if (node->bounds.IntersectP(ray, invDir, dirIsNeg, tMax)) {
+            if (node->nPrimitives > 0) {
+                if (leaf(node->primitivesOffset, (int)node->nPrimitives, (int)node->primType))
+                    return true;
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            } else {
+                if (dirIsNeg[node->axis]) {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node->secondChildOffset;
+                } else {
+                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+            }
+        } else {
+            if (toVisitOffset == 0) break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+    return false;
+}
+
+template <typename LeafFn>
+bool BVHAccel::traversePacket(const Ray* rays, int n, float* tMax, LeafFn&& leaf) const {
+    if (layout != NodeLayout::BINARY || nodes.empty() || n <= 0 || n > kMaxRayPacket)
+        return false;
+    // bounds of the packet's origins and inverse directions for the interval test; a packet whose
+    // rays head into different octants (or run parallel to an axis) has no useful bounds
+    const Vector3f& invDir0 = rays[0].direction_inv;
+    std::array<int, 3> dirIsNeg = { int(invDir0.x < 0), int(invDir0.y < 0), int(invDir0.z < 0) };
+    Vector3f oMin = rays[0].origin, oMax = oMin, invMin = invDir0, invMax = invMin;
+    RayPacket packet;
+    for (int i = 0; i < n; i++) {
+        const Vector3f& invDir = rays[i].direction_inv;
+        for (int a = 0; a < 3; a++) {
+            if (int(invDir[a] < 0) != dirIsNeg[a] || std::isinf(invDir[a]))
+                return false;
+            packet.org[a][i] = rays[i].origin[a];
+            packet.invDir[a][i] = invDir[a];
+        }
+        packet.tMax[i] = tMax[i];
+        oMin = Vector3f::Min(oMin, rays[i].origin);
+        oMax = Vector3f::Max(oMax, rays[i].origin);
+        invMin = Vector3f::Min(invMin, invDir);
+        invMax = Vector3f::Max(invMax, invDir);
+    }
+    // lanes past n are masked out, they only need defined values
+    for (int i = n; i < (n + 3) / 4 * 4; i++) {
+        for (int a = 0; a < 3; a++)
+            packet.org[a][i] = packet.invDir[a][i] = 0;
+        packet.tMax[i] = 0;
+    }
+    float packetTMax = *std::max_element(tMax, tMax + n);
+
+    // Every stack entry keeps the rays still active for it. One interval test decides for the
+    // whole packet whether a node can be skipped; nodes it can not rule out get the slab test of
+    // every active ray, narrowing the mask, so rays that diverge drop out and a single remaining
+    // ray walks on like traverse would (skipping the interval test).
+    struct Entry {
+        int node;
+        uint32_t mask;
+    };
+    Entry nodesToVisit[64];
+    int toVisitOffset = 0;
+    Entry current = { 0, (1u << n) - 1 };
+    while (true) {
+        const LinearBVHNode* node = &nodes[current.node];
+        uint32_t mask = 0;
+        bool single = (current.mask & (current.mask - 1)) == 0;
+        if (single || node->bounds.IntersectP(oMin, oMax, invMin, invMax, packetTMax))
+            mask = packet.intersect(node->bounds, dirIsNeg, current.mask);
+        if (mask) {
+            if (node->nPrimitives > 0) {
+                leaf(node->primitivesOffset, (int)node->nPrimitives, (int)node->primType, mask);
+                for (uint32_t m = mask; m; m &= m - 1)
+                    packet.tMax[__builtin_ctz(m)] = tMax[__builtin_ctz(m)];
+                packetTMax = *std::max_element(tMax, tMax + n);
+                if (toVisitOffset == 0) break;
+                current = nodesToVisit[--toVisitOffset];
+            } else {
+                // all rays share dirIsNeg, so the near child is the same for the whole packet
+                if (dirIsNeg[node->axis]) {
+                    nodesToVisit[toVisitOffset++] = { current.node + 1, mask };
+                    current = { node->secondChildOffset, mask };
+                } else {
+                    nodesToVisit[toVisitOffset++] = { node->secondChildOffset, mask };
+                    current = { current.node + 1, mask };
+                }
+            }
+        } else {
+            if (toVisitOffset == 0) break;
+            current = nodesToVisit[--toVisitOffset];
+        }
+    }
+    return true;
+}
+
+template <int N, typename LeafFn>
+void BVHAccel::traverseWide(const std::vector<WideBVHNode<N>>& wideNodes, const Ray& ray, float tMax,
+    LeafFn& leaf) const {
+    if (wideNodes.empty())
+        return;
+    WideRay wideRay(ray);
+
+    // children are pushed farthest first, so the stack pops them front to back; entries whose
+    // box is entered beyond the current closest hit are dropped when popped
+    struct StackEntry {
+        int child, count, type;
+        float tNear;
+    };
+    StackEntry stack[64 * N];
+    int stackSize = 0;
+    stack[stackSize++] = { 0, 0, 0, 0 };
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+        if (entry.tNear > tMax)
+            continue;
+        if (entry.count > 0) {
+            leaf(entry.child, entry.count, entry.type, tMax);
+            continue;
+        }
+        const WideBVHNode<N>& node = wideNodes[entry.child];
+        alignas(32) float tNear[N];
+        int mask = node.intersect(wideRay, tMax, tNear);
+        // sort hit children by descending entry distance (insertion sort, at most N entries)
+        int order[N];
+        int nHits = 0;
+        for (int i = 0; i < N; ++i) {
+            if (!(mask & (1 << i)) || node.count[i] < 0)
+                continue;
+            int j = nHits++;
+            while (j > 0 && tNear[order[j - 1]] < tNear[i]) {
+                order[j] = order[j - 1];
+                --j;
+            }
+            order[j] = i;
+        }
+        for (int k = 0; k < nHits; ++k) {
+            int i = order[k];
+            stack[stackSize++] = { node.child[i], node.count[i], node.type[i], tNear[i] };
+        }
+    }
+}
+
+template <int N, typename LeafFn>
+bool BVHAccel::traverseAnyWide(const std::vector<WideBVHNode<N>>& wideNodes, const Ray& ray, LeafFn& leaf) const {
+    if (wideNodes.empty())
+        return false;
+    WideRay wideRay(ray);
+    float tMax = ray.t_max;
+    int stack[64 * N];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        const WideBVHNode<N>& node = wideNodes[stack[--stackSize]];
+        alignas(32) float tNear[N];
+        int mask = node.intersect(wideRay, tMax, tNear);
+        for (int i = 0; i < N; ++i) {
+            if (!(mask & (1 << i)) || node.count[i] < 0)
+                continue;
+            if (node.count[i] == 0)
+                stack[stackSize++] = node.child[i];
+            else if (leaf(node.child[i], node.count[i], node.type[i]))
+                return true;
+        }
+    }
+    return false;
+}
+
 
 
 
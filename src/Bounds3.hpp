@@ -2,9 +2,14 @@
 #define RAYTRACING_BOUNDS3_H
 #include "Ray.hpp"
 #include "Vector.hpp"
+#include "global.hpp"
 #include <limits>
 #include <array>
 
+// far slab distances are scaled by this before the overlap test, so rounding in the
+// slab computation can not make a ray miss a box its primitive hit lies in
+constexpr float kRobustSlabScale = 1 + 2 * gammaBound(3);
+
 class Bounds3
 {
   public:
@@ -35,7 +40,7 @@ class Bounds3
             return 2;
     }
 
-    double SurfaceArea() const
+    float SurfaceArea() const
     {
         Vector3f d = Diagonal();
         return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
@@ -81,35 +86,86 @@ class Bounds3
     }
 
     inline bool IntersectP(const Ray& ray, const Vector3f& invDir,
-                           const std::array<int, 3>& dirisNeg) const;
+                           const std::array<int, 3>& dirIsNeg,
+                           float tMax = std::numeric_limits<float>::infinity()) const;
+    // conservative test for a bundle of rays whose origins lie in [oMin, oMax] and whose inverse
+    // directions lie in [invMin, invMax] (one sign per axis): false only if none of them can hit
+    // the box before tMax
+    inline bool IntersectP(const Vector3f& oMin, const Vector3f& oMax, const Vector3f& invMin,
+                           const Vector3f& invMax, float tMax) const;
 };
 
+inline bool Bounds3::IntersectP(const Vector3f& oMin, const Vector3f& oMax, const Vector3f& invMin,
+                                const Vector3f& invMax, float tMax) const
+{
+    // interval arithmetic on the slab distances (p - o) * invDir: the entry distance can be no
+    // less than the smallest corner product of the near plane, the exit no more than the largest
+    // one of the far plane
+    float tMin = -std::numeric_limits<float>::infinity();
+    float tFar = std::numeric_limits<float>::infinity();
+    for (int a = 0; a < 3; a++) {
+        bool neg = invMax[a] < 0;
+        float nearPlane = neg ? pMax[a] : pMin[a], farPlane = neg ? pMin[a] : pMax[a];
+        float n0 = (nearPlane - oMin[a]) * invMin[a], n1 = (nearPlane - oMin[a]) * invMax[a];
+        float n2 = (nearPlane - oMax[a]) * invMin[a], n3 = (nearPlane - oMax[a]) * invMax[a];
+        float f0 = (farPlane - oMin[a]) * invMin[a], f1 = (farPlane - oMin[a]) * invMax[a];
+        float f2 = (farPlane - oMax[a]) * invMin[a], f3 = (farPlane - oMax[a]) * invMax[a];
+        tMin = std::max(tMin, std::min(std::min(n0, n1), std::min(n2, n3)));
+        tFar = std::min(tFar, std::max(std::max(f0, f1), std::max(f2, f3)) * kRobustSlabScale);
+    }
+    return tMin <= tFar && tMin < tMax && tFar > 0;
+}
+
 
 
 inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
-                                const std::array<int, 3>& dirIsNeg) const
+                                const std::array<int, 3>& dirIsNeg, float tMax) const
 {
     // invDir: ray direction(x,y,z), invDir=(1.0/x,1.0/y,1.0/z), use this because Multiply is faster that Division
-    // dirIsNeg: ray direction(x,y,z), dirIsNeg=[int(x>0),int(y>0),int(z>0)], use this to simplify your logic
-    // TODO test if ray bound intersects
-    float nmin = std::numeric_limits<float>::min(), nmax = std::numeric_limits<float>::max();
-    for (int iAxis = 0; iAxis < 3; iAxis++)
-    {
-        float o = ray.origin[iAxis];
-        float invD = invDir[iAxis];
-        float t1 = (this->pMin[iAxis] - o) * invD;
-        float t2 = (this->pMax[iAxis] - o) * invD;
-        if (t1 > t2){
-            std::swap(t1, t2);
-        }
-        nmin = std::max(nmin, t1);
-        nmax = std::min(nmax, t2);
+    // dirIsNeg: ray direction(x,y,z), dirIsNeg=[int(x<0),int(y<0),int(z<0)], picks the near/far slab without swapping
+    // tMax: closest hit found so far, boxes entered beyond it can be skipped
+#ifdef RAYTRACING_SIMD_VECTOR
+    // all three slabs at once, the near/far planes picked per axis by the sign of invDir
+    __m128 neg = _mm_cmplt_ps(invDir.simd(), _mm_setzero_ps());
+    __m128 lo = _mm_or_ps(_mm_and_ps(neg, pMax.simd()), _mm_andnot_ps(neg, pMin.simd()));
+    __m128 hi = _mm_or_ps(_mm_and_ps(neg, pMin.simd()), _mm_andnot_ps(neg, pMax.simd()));
+    __m128 tn = _mm_mul_ps(_mm_sub_ps(lo, ray.origin.simd()), invDir.simd());
+    __m128 tf = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(hi, ray.origin.simd()), invDir.simd()),
+                           _mm_set1_ps(kRobustSlabScale));
+    // the max/min chain returns its second operand for NaN slabs (0 * inf on axis-parallel rays),
+    // so those axes leave the interval as it was
+    __m128 tNear = _mm_set_ss(-std::numeric_limits<float>::infinity());
+    __m128 tFarV = _mm_set_ss(std::numeric_limits<float>::infinity());
+    for (int a = 0; a < 3; a++) {
+        tNear = _mm_max_ss(tn, tNear);
+        tFarV = _mm_min_ss(tf, tFarV);
+        tn = _mm_shuffle_ps(tn, tn, _MM_SHUFFLE(0, 3, 2, 1));
+        tf = _mm_shuffle_ps(tf, tf, _MM_SHUFFLE(0, 3, 2, 1));
     }
+    float tMin = _mm_cvtss_f32(tNear), tFar = _mm_cvtss_f32(tFarV);
+    (void)dirIsNeg;
+    return tMin <= tFar && tMin < tMax && tFar > 0;
+#else
+    const Bounds3& bounds = *this;
+    float tMin = (bounds[dirIsNeg[0]].x - ray.origin.x) * invDir.x;
+    float tFar = (bounds[1 - dirIsNeg[0]].x - ray.origin.x) * invDir.x * kRobustSlabScale;
+    float tyMin = (bounds[dirIsNeg[1]].y - ray.origin.y) * invDir.y;
+    float tyMax = (bounds[1 - dirIsNeg[1]].y - ray.origin.y) * invDir.y * kRobustSlabScale;
+    // written so that NaNs from 0 * inf on axis-parallel rays fail the comparisons
+    if (tMin > tyMax || tyMin > tFar)
+        return false;
+    if (tyMin > tMin) tMin = tyMin;
+    if (tyMax < tFar) tFar = tyMax;
 
-    if (nmax > 0.0f && nmin <= nmax){
-        return true;
-    }
-    return false;
+    float tzMin = (bounds[dirIsNeg[2]].z - ray.origin.z) * invDir.z;
+    float tzMax = (bounds[1 - dirIsNeg[2]].z - ray.origin.z) * invDir.z * kRobustSlabScale;
+    if (tMin > tzMax || tzMin > tFar)
+        return false;
+    if (tzMin > tMin) tMin = tzMin;
+    if (tzMax < tFar) tFar = tzMax;
+
+    return (tMin < tMax) && (tFar > 0);
+#endif
 }
 
 inline Bounds3 Union(const Bounds3& b1, const Bounds3& b2)
@@ -0,0 +1,70 @@
+#include "Film.hpp"
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+// "MRTFILM" and the format version: 2 added FilmState::sampleOffset
+static const char kFilmMagic[8] = { 'M', 'R', 'T', 'F', 'I', 'L', 'M', '2' };
+static const int kPixelBytes = 24;
+
+bool Film::save(const char* filename, const FilmState& state) const {
+    std::string temporary = std::string(filename) + ".tmp";
+    FILE* fp = fopen(temporary.c_str(), "wb");
+    if (!fp)
+        return false;
+    int32_t size[2] = { width, height };
+    bool ok = fwrite(kFilmMagic, sizeof(kFilmMagic), 1, fp) == 1 && fwrite(size, sizeof(size), 1, fp) == 1 &&
+              fwrite(&state, sizeof(FilmState), 1, fp) == 1;
+    std::vector<unsigned char> buffer(pixels.size() * kPixelBytes);
+    for (size_t i = 0; i < pixels.size(); i++) {
+        const FilmPixel& p = pixels[i];
+        float values[6] = { p.sum.x, p.sum.y, p.sum.z, 0, p.lumMean, p.lumM2 };
+        std::memcpy(&values[3], &p.count, sizeof(uint32_t));
+        std::memcpy(&buffer[i * kPixelBytes], values, kPixelBytes);
+    }
+    ok = ok && fwrite(buffer.data(), 1, buffer.size(), fp) == buffer.size();
+    ok = fclose(fp) == 0 && ok;
+    return ok && std::rename(temporary.c_str(), filename) == 0;
+}
+
+bool Film::load(const char* filename, FilmState& state, std::string& error) {
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) {
+        error = "can not open the file";
+        return false;
+    }
+    char magic[sizeof(kFilmMagic)];
+    int32_t size[2] = { 0, 0 };
+    FilmState fileState;
+    std::vector<unsigned char> buffer(pixels.size() * kPixelBytes);
+    bool ok = false;
+    const int versionByte = sizeof(kFilmMagic) - 1;
+    if (fread(magic, sizeof(magic), 1, fp) != 1 || std::memcmp(magic, kFilmMagic, versionByte) != 0)
+        error = "not a film file";
+    else if (magic[versionByte] != kFilmMagic[versionByte])
+        error = std::string("film file format version ") + magic[versionByte] + ", this build reads version " +
+                kFilmMagic[versionByte];
+    else if (fread(size, sizeof(size), 1, fp) != 1 || fread(&fileState, sizeof(FilmState), 1, fp) != 1)
+        error = "truncated film file";
+    else if (size[0] != width || size[1] != height)
+        error = "a " + std::to_string(size[0]) + "x" + std::to_string(size[1]) + " film, the image is " +
+                std::to_string(width) + "x" + std::to_string(height);
+    else if (fread(buffer.data(), 1, buffer.size(), fp) != buffer.size())
+        error = "truncated film file";
+    else
+        ok = true;
+    fclose(fp);
+    if (!ok)
+        return false;
+    for (size_t i = 0; i < pixels.size(); i++) {
+        float values[6];
+        std::memcpy(values, &buffer[i * kPixelBytes], kPixelBytes);
+        FilmPixel& p = pixels[i];
+        p.sum = Vector3f(values[0], values[1], values[2]);
+        std::memcpy(&p.count, &values[3], sizeof(uint32_t));
+        p.lumMean = values[4];
+        p.lumM2 = values[5];
+    }
+    state = fileState;
+    return true;
+}
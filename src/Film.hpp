@@ -0,0 +1,100 @@
+#ifndef RAYTRACING_FILM_H
+#define RAYTRACING_FILM_H
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+#include "Vector.hpp"
+
+inline float luminance(const Vector3f& c) { return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
+
+// Unclamped samples of one pixel: their sum and count, plus the running mean and squared
+// deviation of their luminance (Welford) for an error estimate without storing the samples.
+// The statistics use the luminance clamped to the displayable [0, 1] like SavePPM does, so a
+// rare firefly that will be clipped anyway does not make its pixel look hopelessly noisy.
+struct FilmPixel {
+    Vector3f sum;
+    uint32_t count = 0;
+    float lumMean = 0, lumM2 = 0;
+
+    void addSample(const Vector3f& L) {
+        sum += L;
+        count++;
+        float y = std::min(luminance(L), 1.0f);
+        float delta = y - lumMean;
+        lumMean += delta / count;
+        lumM2 += delta * (y - lumMean);
+    }
+    // adds the samples of another pixel, combining the statistics with Chan et al.'s formula
+    void merge(const FilmPixel& other) {
+        if (other.count == 0)
+            return;
+        uint32_t n = count + other.count;
+        float delta = other.lumMean - lumMean;
+        lumMean += delta * other.count / n;
+        lumM2 += other.lumM2 + delta * delta * ((float)count * other.count / n);
+        sum += other.sum;
+        count = n;
+    }
+    Vector3f average() const { return count > 0 ? sum / count : Vector3f(0); }
+    // standard error of the mean luminance relative to the mean, eps keeps black pixels from
+    // reading as infinitely noisy; unknown before two samples
+    float relativeError(float eps = 1e-2f) const {
+        if (count < 2)
+            return std::numeric_limits<float>::infinity();
+        float variance = lumM2 / (count - 1);
+        return std::sqrt(variance / count) / (lumMean + eps);
+    }
+};
+
+// What a saved film needs besides its pixels to continue the render. The random numbers are a
+// function of pixel, sample index and dimension (Sampler.hpp), so the per-pixel counts plus the
+// sampler's type and seed are the complete RNG state.
+struct FilmState {
+    int32_t spp = 0;         // target samples per pixel
+    int32_t samplerType = 0; // SamplerType
+    uint32_t seed = 0;
+    int32_t samplesDone = 0; // samples every pixel got from completed passes
+    int32_t passes = 0;
+    uint32_t sampleOffset = 0; // sample index of every pixel's first sample
+};
+
+// HDR accumulation buffer of a render, every pixel can hold a different number of samples
+struct Film {
+    int width, height;
+    std::vector<FilmPixel> pixels;
+
+    Film(int width, int height) : width(width), height(height), pixels(width * height) {}
+
+    // per-pixel averages, ready for Renderer::SavePPM
+    std::vector<Vector3f> image() const {
+        std::vector<Vector3f> framebuffer(pixels.size());
+        for (size_t i = 0; i < pixels.size(); i++)
+            framebuffer[i] = pixels[i].average();
+        return framebuffer;
+    }
+    uint64_t sampleCount() const {
+        uint64_t n = 0;
+        for (const FilmPixel& p : pixels)
+            n += p.count;
+        return n;
+    }
+
+    // Binary film file: a header with the format version, size and state, then sum, count and
+    // luminance statistics of every pixel, 24 bytes each. save writes a temporary file and renames
+    // it over filename, so an interrupted save leaves the previous file intact. load fails (and
+    // leaves the film unchanged) on a missing or truncated file, another format version or a size
+    // other than this film's, error says which.
+    bool save(const char* filename, const FilmState& state) const;
+    bool load(const char* filename, FilmState& state, std::string& error);
+    // adds the samples of another film of the same size, e.g. a part of the render done by
+    // another process with a different sample offset
+    void merge(const Film& other) {
+        for (size_t i = 0; i < pixels.size(); i++)
+            pixels[i].merge(other.pixels[i]);
+    }
+};
+
+#endif //RAYTRACING_FILM_H
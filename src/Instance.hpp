@@ -0,0 +1,77 @@
+#ifndef RAYTRACING_INSTANCE_H
+#define RAYTRACING_INSTANCE_H
+
+#include "Object.hpp"
+#include "Transform.hpp"
+
+// A placed copy of a shared object (typically a MeshTriangle with its own BVH).
+// Rays are moved into object space instead of copying the geometry, so any number
+// of instances share one set of triangles and one bottom-level BVH; the scene BVH
+// over the instances is the top level. The direction is transformed without
+// renormalizing, which keeps hit distances identical in both spaces.
+class Instance : public Object {
+public:
+    Instance(Object* prototype, const Transform& objectToWorld) : prototype(prototype) {
+        setTransform(objectToWorld);
+    }
+
+    // moving an instance only needs the top-level BVH (Scene::buildBVH) to be rebuilt
+    void setTransform(const Transform& objectToWorld) {
+        this->objectToWorld = objectToWorld;
+        worldToObject = objectToWorld.inverse();
+        bounds = objectToWorld.bounds(prototype->getBounds());
+        // exact for rigid motions and uniform scales
+        areaScale = std::pow(std::fabs(objectToWorld.determinant()), 2.0f / 3.0f);
+    }
+
+    bool intersect(const Ray& ray) { return prototype->intersect(toObject(ray)); }
+    bool intersect(const Ray& ray, float& tnear, uint32_t& index) const {
+        return prototype->intersect(toObject(ray), tnear, index);
+    }
+
+    // the object space direction is not renormalized, so hit.t is valid in both spaces
+    bool intersect(const Ray& ray, HitRecord& hit) { return prototype->intersect(toObject(ray), hit); }
+    Intersection finalize(const Ray& ray, const HitRecord& hit) {
+        Intersection isect = prototype->finalize(toObject(ray), hit);
+        isect.coords = objectToWorld.point(isect.coords, isect.pError, &isect.pError);
+        isect.normal = normalize(objectToWorld.normal(isect.normal));
+        isect.geoNormal = normalize(objectToWorld.normal(isect.geoNormal));
+        return isect;
+    }
+
+    bool occluded(const Ray& ray) { return prototype->occluded(toObject(ray)); }
+
+    void getSurfaceProperties(const Vector3f& P, const Vector3f& I, const uint32_t& index, const Vector2f& uv,
+                              Vector3f& N, Vector2f& st) const {
+        prototype->getSurfaceProperties(worldToObject.point(P), worldToObject.vector(I), index, uv, N, st);
+        N = normalize(objectToWorld.normal(N));
+    }
+    Vector3f evalDiffuseColor(const Vector2f& st) const { return prototype->evalDiffuseColor(st); }
+    Bounds3 getBounds() { return bounds; }
+    float getArea() { return prototype->getArea() * areaScale; }
+    void Sample(Intersection& pos, float& pdf, Sampler& sampler) {
+        prototype->Sample(pos, pdf, sampler);
+        pos.coords = objectToWorld.point(pos.coords, pos.pError, &pos.pError);
+        pos.normal = normalize(objectToWorld.normal(pos.normal));
+        pos.geoNormal = normalize(objectToWorld.normal(pos.geoNormal));
+        pdf /= areaScale;
+    }
+    bool hasEmit() { return prototype->hasEmit(); }
+    void buildAccel() { prototype->buildAccel(); }
+
+    Object* prototype;
+    Transform objectToWorld, worldToObject;
+
+private:
+    Ray toObject(const Ray& ray) const {
+        Ray r(worldToObject.point(ray.origin), worldToObject.vector(ray.direction), ray.t);
+        r.t_min = ray.t_min;
+        r.t_max = ray.t_max;
+        return r;
+    }
+
+    Bounds3 bounds;
+    float areaScale;
+};
+
+#endif //RAYTRACING_INSTANCE_H
@@ -1,7 +1,9 @@
 #ifndef RAYTRACING_INTERSECTION_H
 #define RAYTRACING_INTERSECTION_H
+#include <limits>
 #include "Vector.hpp"
 #include "Material.hpp"
+#include "Ray.hpp"
 class Object;
 class Sphere;
 
@@ -11,7 +13,7 @@ struct Intersection
         happened=false;
         coords=Vector3f();
         normal=Vector3f();
-        distance= std::numeric_limits<double>::max();
+        distance= std::numeric_limits<float>::infinity();
         obj =nullptr;
         m=nullptr;
     }
@@ -19,9 +21,39 @@ struct Intersection
     Vector3f coords;
     Vector3f tcoords;
     Vector3f normal;
+    Vector3f geoNormal;     // normal of the actual surface, spawned rays are offset along it
+    Vector3f pError;        // bound on the absolute rounding error of coords
     Vector3f emit;
-    double distance;
+    float distance;
     Object* obj;
     Material* m;
+
+    // ray leaving the surface in direction d, its origin moved past the error bound of coords
+    Ray spawnRay(const Vector3f& d) const {
+        return Ray(offsetRayOrigin(coords, pError, geoNormal, d), d);
+    }
+    // shadow ray towards the surface point to, both ends offset off their surfaces; t_max stops
+    // a relative ShadowEpsilon short of it, which leaves out hits on the target itself
+    Ray spawnRayTo(const Intersection& to) const {
+        Vector3f pFrom = offsetRayOrigin(coords, pError, geoNormal, to.coords - coords);
+        Vector3f pTo = offsetRayOrigin(to.coords, to.pError, to.geoNormal, pFrom - to.coords);
+        Vector3f d = pTo - pFrom;
+        float dist = d.norm();
+        Ray ray(pFrom, d / dist);
+        ray.t_max = dist * (1 - ShadowEpsilon);
+        return ray;
+    }
+    static constexpr float ShadowEpsilon = 0.0001f;
+};
+
+// What traversal carries around: just enough to identify the closest hit so
+// far. The full Intersection is built once from it by Object::finalize.
+struct HitRecord
+{
+    explicit HitRecord(float tMax = std::numeric_limits<float>::infinity()) : t(tMax) {}
+    float t;            // distance of the closest hit, later candidates must be closer
+    int primId = -1;    // sub-primitive of the hit object (triangle of a mesh), -1: no hit yet
+    int instId = -1;    // scene-level primitive (BVH leaf slot) the hit belongs to
+    float u = 0, v = 0; // barycentrics of triangle hits
 };
 #endif //RAYTRACING_INTERSECTION_H
@@ -107,9 +107,10 @@ private:
         return ggx1 * ggx2;
     }
 
-    Vector3f sampleGGX(const Vector3f& wi, const Vector3f& N) const {
-        float r0 = get_random_float();
-        float r1 = get_random_float();
+    Vector3f sampleGGX(const Vector3f& wi, const Vector3f& N, Sampler& sampler) const {
+        Vector2f u = sampler.get2D();
+        float r0 = u.x;
+        float r1 = u.y;
         float a2 = roughness * roughness;
         float theta = acosf(sqrtf((1 - r0) / ((a2 - 1) * r0 + 1)));
         float phi = 2 * M_PI * r1;
@@ -148,7 +149,7 @@ public:
     inline bool hasEmission();
 
     // sample a ray by Material properties
-    inline Vector3f sample(const Vector3f& wi, const Vector3f& N);
+    inline Vector3f sample(const Vector3f& wi, const Vector3f& N, Sampler& sampler);
     // given a ray, calculate the PdF of this ray
     inline float pdf(const Vector3f& wi, const Vector3f& wo, const Vector3f& N);
     // given a ray, calculate the contribution of this ray
@@ -177,12 +178,13 @@ Vector3f Material::getColorAt(double u, double v) {
 }
 
 
-Vector3f Material::sample(const Vector3f& wi, const Vector3f& N) {
+Vector3f Material::sample(const Vector3f& wi, const Vector3f& N, Sampler& sampler) {
     switch (m_type) {
     case DIFFUSE:
     {
         // uniform sample on the hemisphere
-        float x_1 = get_random_float(), x_2 = get_random_float();
+        Vector2f u = sampler.get2D();
+        float x_1 = u.x, x_2 = u.y;
         float z = std::fabs(1.0f - 2.0f * x_1);
         float r = std::sqrt(1.0f - z * z), phi = 2 * M_PI * x_2;
         Vector3f localRay(r * std::cos(phi), r * std::sin(phi), z);
@@ -191,7 +193,7 @@ Vector3f Material::sample(const Vector3f& wi, const Vector3f& N) {
     }
     case MICROFACET:
     {
-        return sampleGGX(wi, N);
+        return sampleGGX(wi, N, sampler);
         break;
     }
     }
@@ -15,13 +15,34 @@ public:
     virtual ~Object() {}
     virtual bool intersect(const Ray& ray) = 0;
     virtual bool intersect(const Ray& ray, float &, uint32_t &) const = 0;
-    virtual Intersection getIntersection(Ray _ray) = 0;
+    // closest hit nearer than hit.t: stores t, primId and u/v in hit and returns true
+    virtual bool intersect(const Ray& ray, HitRecord& hit) = 0;
+    // position, normal, material and emission of a hit reported by intersect
+    virtual Intersection finalize(const Ray& ray, const HitRecord& hit) = 0;
+    virtual Intersection getIntersection(const Ray& ray) {
+        HitRecord hit(ray.t_max);
+        return intersect(ray, hit) ? finalize(ray, hit) : Intersection();
+    }
+    // any-hit query: is there a hit with distance in (0, ray.t_max)? no shading data is built
+    virtual bool occluded(const Ray& ray) = 0;
     virtual void getSurfaceProperties(const Vector3f &, const Vector3f &, const uint32_t &, const Vector2f &, Vector3f &, Vector2f &) const = 0;
     virtual Vector3f evalDiffuseColor(const Vector2f &) const =0;
     virtual Bounds3 getBounds()=0;
     virtual float getArea()=0;
-    virtual void Sample(Intersection &pos, float &pdf)=0;
+    virtual void Sample(Intersection &pos, float &pdf, Sampler &sampler)=0;
     virtual bool hasEmit()=0;
+    // sub-primitives (e.g. the triangles of a mesh) a compiled scene BVH references directly;
+    // an object that is a single primitive keeps the defaults
+    virtual int primitiveCount() { return 1; }
+    virtual Bounds3 primitiveBounds(int) { return getBounds(); }
+    virtual bool intersectPrimitive(int, const Ray& ray, HitRecord& hit) { return intersect(ray, hit); }
+    virtual bool primitiveOccluded(int, const Ray& ray) { return occluded(ray); }
+    // vertices of sub-primitive k if it is a plain triangle, lets Scene::compile pack it with the others
+    virtual bool primitiveTriangle(int, Vector3f&, Vector3f&, Vector3f&) { return false; }
+    // builds what intersect and occluded traverse, if the object has its own acceleration
+    // structure; Scene::buildBVH calls it for every object, Scene::compile only for objects it
+    // does not break into packed triangles
+    virtual void buildAccel() {}
 };
 
 
@@ -5,6 +5,9 @@
 #include "Scene.hpp"
 #include "Renderer.hpp"
 #include <thread>
+#include <algorithm>
+#include <numeric>
+#include <future>
 
 inline float deg2rad(const float& deg) { return deg * M_PI / 180.0; }
 
@@ -14,26 +17,19 @@ const float EPSILON = 0.00001;
 // generate primary rays and cast these rays into the scene. The content of the
 // framebuffer is saved to a file.
 void Renderer::RenderMultithread(const Scene& scene) {
-    //treat as camera
-    Vector3f eye_pos(278, 273, -800);
     std::vector<Vector3f> framebuffer(scene.width * scene.height);
 
-    int total_pixel = scene.width * scene.height;
-    int pixel_per_thread = total_pixel / num_of_thread;
-    int rest_pixel = total_pixel - pixel_per_thread * num_of_thread;
-    int low = 0;
+    TileScheduler scheduler(scene.width, scene.height, tile_size, num_of_thread);
     std::vector<std::thread> tasks;
-    std::clog << "num_of_thread: " << num_of_thread << ", SPP: " << spp << "\n";
+    std::clog << "num_of_thread: " << num_of_thread << ", SPP: " << spp
+        << ", tiles: " << scheduler.tileCount() << " (" << tile_size << "x" << tile_size << ")";
+    if (wavefront_size > 0)
+        std::clog << ", wavefront: " << wavefront_size << " paths";
+    std::clog << "\n";
     for (int i = 0; i < num_of_thread; i++) {
-        MonotaskInfo info(low, low + pixel_per_thread, eye_pos, spp, framebuffer);
-        low += pixel_per_thread;
-        if (rest_pixel) {
-            rest_pixel--;
-            info.highIndex++;
-            low++;
-        }
-        tasks.emplace_back(&Renderer::RenderMonotask, this, info, std::ref(scene), i == num_of_thread-1);
-        // tasks.push_back(std::thread(&Renderer::doSomething, this, i));
+        MonotaskInfo info(i, eye_pos, spp, framebuffer, scheduler);
+        tasks.emplace_back(wavefront_size > 0 ? &Renderer::WavefrontMonotask : &Renderer::RenderMonotask, this, info,
+                           std::ref(scene), true);
     }
 
 
@@ -47,6 +43,237 @@ void Renderer::RenderMultithread(const Scene& scene) {
     SavePPM(image_name, scene.width, scene.height, framebuffer);
 }
 
+bool Renderer::RenderPass(const Scene& scene, Film& film, const std::vector<int>& samples, Deadline deadline) {
+    TileScheduler scheduler(scene.width, scene.height, tile_size, num_of_thread);
+    std::vector<std::thread> tasks;
+    for (int i = 0; i < num_of_thread; i++) {
+        tasks.emplace_back(&Renderer::RenderPassMonotask, this, i, std::ref(scheduler), std::ref(scene),
+                           std::ref(film), std::cref(samples), deadline);
+    }
+    for (int i = 0; i < tasks.size(); i++) {
+        tasks[i].join();
+    }
+    return scheduler.tilesCompleted() == scheduler.tileCount();
+}
+
+void Renderer::RenderPassMonotask(int threadIndex, TileScheduler& scheduler, const Scene& scene, Film& film,
+                                  const std::vector<int>& samples, Deadline deadline) {
+    ImageTile tile;
+    while (std::chrono::steady_clock::now() < deadline && scheduler.next(threadIndex, tile)) {
+        for (int j = tile.y0; j < tile.y1; j++) {
+            for (int i = tile.x0; i < tile.x1; i++) {
+                int index = j * scene.width + i;
+                FilmPixel& pixel = film.pixels[index];
+                for (int k = 0; k < samples[index]; k++) {
+                    Sampler sampler(sampler_type, spp);
+                    sampler.startPixelSample(index, sample_offset + pixel.count);
+                    Ray ray = CameraRay(scene, eye_pos, i, j, sampler);
+                    pixel.addSample(scene.castRay(ray, 0, sampler));
+                }
+            }
+        }
+        scheduler.complete(tile);
+    }
+}
+
+// Adaptive sampling: a base pass gives every pixel a quarter of spp, then every pass estimates
+// the relative error of each pixel from its running luminance variance and gives the pixels
+// above adaptive_threshold the samples they need to reach it (the error falls as 1/sqrt(n)).
+// A pass at most doubles a pixel's samples so the estimates are refreshed before more is spent,
+// no pixel gets more than 8 * spp, and the total never exceeds spp samples per pixel on
+// average. Converged and black regions stop early, the remaining budget is simply not spent.
+void Renderer::RenderAdaptive(const Scene& scene) {
+    Film film(scene.width, scene.height);
+    uint64_t budget = uint64_t(spp) * film.pixels.size();
+    int maxSpp = spp * 8;
+    std::vector<int> samples(film.pixels.size(), std::min(spp, std::max(2, spp / 4)));
+    std::vector<double> wanted(film.pixels.size());
+    std::vector<float> errors(film.pixels.size());
+    std::clog << "num_of_thread: " << num_of_thread << ", SPP budget: " << spp
+        << ", adaptive threshold: " << adaptive_threshold << "\n";
+    for (int pass = 0;; pass++) {
+        RenderPass(scene, film, samples);
+        uint64_t used = film.sampleCount();
+        // a pixel's estimate from a few samples is itself noisy, the largest error in its 3x3
+        // neighbourhood also catches pixels whose samples have not hit the rare paths yet
+        for (size_t p = 0; p < film.pixels.size(); p++)
+            errors[p] = film.pixels[p].relativeError();
+        int noisy = 0;
+        double total = 0;
+        for (size_t p = 0; p < film.pixels.size(); p++) {
+            const FilmPixel& pixel = film.pixels[p];
+            int x = p % scene.width, y = p / scene.width;
+            float error = 0;
+            for (int ny = std::max(0, y - 1); ny <= std::min(scene.height - 1, y + 1); ny++)
+                for (int nx = std::max(0, x - 1); nx <= std::min(scene.width - 1, x + 1); nx++)
+                    error = std::max(error, errors[ny * scene.width + nx]);
+            double want = 0;
+            if (error > adaptive_threshold) {
+                noisy++;
+                want = pixel.count * (double(error / adaptive_threshold) * (error / adaptive_threshold) - 1);
+                want = std::min({ want, (double)pixel.count, double(maxSpp - (int)pixel.count) });
+            }
+            wanted[p] = std::max(want, 0.0);
+            total += wanted[p];
+        }
+        printf("adaptive pass %d: %.2f spp on average, %d pixels above the threshold\n", pass,
+               used / (double)film.pixels.size(), noisy);
+        if (used >= budget || total < 1)
+            break;
+        // scaled down evenly when the wanted samples exceed what is left of the budget
+        double scale = std::min(1.0, (budget - used) / total);
+        uint64_t planned = 0;
+        for (size_t p = 0; p < film.pixels.size(); p++) {
+            samples[p] = int(wanted[p] * scale);
+            planned += samples[p];
+        }
+        if (planned == 0)
+            break;
+    }
+    printf("rendering...complete!\n");
+
+    std::vector<Vector3f> framebuffer = film.image();
+    char image_name[256];
+    sprintf(image_name, "image/%dx%d_%dspp_%d.ppm", scene.width, scene.height, spp, std::time(0));
+    SavePPM(image_name, scene.width, scene.height, framebuffer);
+    if (save_sample_map) {
+        sprintf(image_name, "image/%dx%d_%dspp_%d_samples.ppm", scene.width, scene.height, spp, std::time(0));
+        SaveSampleMap(image_name, film);
+    }
+}
+
+// Progressive rendering: passes over the whole frame into an HDR film until the time budget
+// runs out, the mean relative error of the pixels drops to noise_target or every pixel has spp
+// samples. Every pass doubles the samples so far (Sobol points stay in complete power-of-two
+// sets) up to max_pass_spp, and is shrunk to what the last pass's speed says fits in the time
+// left. A pass that overruns the deadline stops handing out tiles, so pixels may end with
+// different counts, which the film's per-pixel averages account for.
+void Renderer::RenderProgressive(const Scene& scene) {
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point start = Clock::now();
+    Deadline deadline = time_budget > 0
+        ? start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(time_budget))
+        : Deadline::max();
+    Film film(scene.width, scene.height);
+    FilmState state;
+    state.spp = spp;
+    state.samplerType = (int)sampler_type;
+    state.sampleOffset = sample_offset;
+    if (!resume_path.empty()) {
+        // the pass schedule only depends on the samples done, and the random numbers on the
+        // sample indices, so continuing a film renders exactly what an uninterrupted run would
+        FilmState saved;
+        std::string error;
+        if (!film.load(resume_path.c_str(), saved, error)) {
+            std::cerr << "can not resume from " << resume_path << ": " << error << "\n";
+            return;
+        }
+        if (saved.samplerType != state.samplerType || saved.seed != state.seed ||
+            saved.sampleOffset != state.sampleOffset) {
+            std::cerr << "can not resume from " << resume_path << ": rendered with another sampler\n";
+            return;
+        }
+        state.samplesDone = saved.samplesDone;
+        state.passes = saved.passes;
+        std::clog << "resuming " << resume_path << " at " << state.samplesDone << " spp\n";
+    }
+    std::clog << "num_of_thread: " << num_of_thread << ", progressive up to " << spp << " spp";
+    if (time_budget > 0)
+        std::clog << ", time budget: " << time_budget << "s";
+    if (noise_target > 0)
+        std::clog << ", noise target: " << noise_target;
+    std::clog << "\n";
+
+    // Checkpoints are written from a copy of the film by a background thread while the next
+    // pass renders; a new one waits for the previous write to finish.
+    std::future<bool> checkpointWrite;
+    Clock::time_point lastCheckpoint = start;
+    auto checkpoint = [&]() {
+        if (checkpointWrite.valid() && !checkpointWrite.get())
+            std::cerr << "failed to write checkpoint " << checkpoint_path << "\n";
+        checkpointWrite = std::async(std::launch::async, [this, snapshot = film, state]() {
+            return snapshot.save(checkpoint_path.c_str(), state);
+        });
+        lastCheckpoint = Clock::now();
+    };
+
+    int& done = state.samplesDone; // samples every pixel got from completed passes
+    double secondsPerSpp = 0;
+    float noise = std::numeric_limits<float>::infinity();
+    for (int pass = state.passes; done < spp; pass++) {
+        int passSpp = std::min({ std::max(done, 1), max_pass_spp, spp - done });
+        if (time_budget > 0 && secondsPerSpp > 0) {
+            double left = std::chrono::duration<double>(deadline - Clock::now()).count();
+            passSpp = std::max(1, std::min(passSpp, int(left / secondsPerSpp)));
+        }
+        Clock::time_point passStart = Clock::now();
+        if (passStart >= deadline)
+            break;
+        // every pixel is brought up to done + passSpp samples: the pixels of a pass the deadline
+        // cut short (here or in the run being resumed) already have some of them
+        std::vector<int> samples(film.pixels.size());
+        for (size_t p = 0; p < film.pixels.size(); p++)
+            samples[p] = std::max(0, done + passSpp - (int)film.pixels[p].count);
+        bool complete = RenderPass(scene, film, samples, deadline);
+        double passSeconds = std::chrono::duration<double>(Clock::now() - passStart).count();
+        secondsPerSpp = passSeconds / passSpp;
+        if (complete) {
+            done += passSpp;
+            state.passes = pass + 1;
+        }
+
+        // mean relative error over the pixels that have an estimate and are not black
+        double errorSum = 0;
+        int counted = 0;
+        for (const FilmPixel& pixel : film.pixels) {
+            float error = pixel.relativeError();
+            if (pixel.lumMean > 0 && std::isfinite(error)) {
+                errorSum += error;
+                counted++;
+            }
+        }
+        noise = counted > 0 ? float(errorSum / counted) : std::numeric_limits<float>::infinity();
+        printf("progressive pass %d: +%d spp in %.2fs, %.2f spp on average, noise %.4f\n", pass, passSpp,
+               passSeconds, film.sampleCount() / (double)film.pixels.size(), noise);
+        if (noise_target > 0 && noise <= noise_target)
+            break;
+        if (!checkpoint_path.empty() && done < spp &&
+            std::chrono::duration<double>(Clock::now() - lastCheckpoint).count() >= checkpoint_interval)
+            checkpoint();
+    }
+    if (!checkpoint_path.empty()) {
+        checkpoint();
+        if (!checkpointWrite.get())
+            std::cerr << "failed to write checkpoint " << checkpoint_path << "\n";
+    }
+
+    uint32_t minCount = std::numeric_limits<uint32_t>::max();
+    for (const FilmPixel& pixel : film.pixels)
+        minCount = std::min(minCount, pixel.count);
+    double reached = film.sampleCount() / (double)film.pixels.size();
+    printf("rendering...complete! %.2f spp on average (at least %u per pixel) in %.2fs, noise %.4f\n", reached,
+           minCount, std::chrono::duration<double>(Clock::now() - start).count(), noise);
+
+    std::vector<Vector3f> framebuffer = film.image();
+    char image_name[256];
+    sprintf(image_name, "image/%dx%d_%dspp_%d.ppm", scene.width, scene.height, int(reached), std::time(0));
+    SavePPM(image_name, scene.width, scene.height, framebuffer);
+}
+
+void Renderer::SaveSampleMap(const char* filename, const Film& film) const {
+    uint32_t maxCount = 1;
+    for (const FilmPixel& pixel : film.pixels)
+        maxCount = std::max(maxCount, pixel.count);
+    FILE* fp = fopen(filename, "wb");
+    (void)fprintf(fp, "P6\n%d %d\n255\n", film.width, film.height);
+    for (const FilmPixel& pixel : film.pixels) {
+        unsigned char level = (unsigned char)(255 * pixel.count / maxCount);
+        unsigned char color[3] = { level, level, level };
+        fwrite(color, 1, 3, fp);
+    }
+    fclose(fp);
+}
+
 void Renderer::SavePPM(const char* filename, int width, int height, std::vector<Vector3f>& framebuffer) const {
     FILE* fp = fopen(filename, "wb");
     (void)fprintf(fp, "P6\n%d %d\n255\n", width, height);
@@ -65,39 +292,237 @@ void Renderer::SavePPM(const char* filename, int width, int height, std::vector<
 }
 
 void Renderer::RenderMonotask(MonotaskInfo info, const Scene& scene, bool displayProgress) {
+    ImageTile tile;
+    float pixel_weight = 1.0f / (scene.width * scene.height);
+    while (info.scheduler.next(info.threadIndex, tile)) {
+        RenderTile(tile, info, scene);
+        // every tile bumps the shared counter, so exactly one thread reports each 5% step
+        float progress = info.scheduler.complete(tile);
+        float previous = progress - tile.pixelCount() * pixel_weight;
+        if (displayProgress && int(progress * 20) > int(previous * 20)) {
+            printf("rendering...%.2f%%\n", 100 * progress);
+        }
+    }
+}
+
+Ray Renderer::CameraRay(const Scene& scene, const Vector3f& eye_pos, int i, int j, Sampler& sampler) const {
     float scale = tan(deg2rad(scene.fov * 0.5));
     float imageAspectRatio = scene.width / (float)scene.height;
-    int last = info.lowIndex;
-    printf( "thread#%d render %d to %d\n", std::this_thread::get_id(), info.lowIndex, info.highIndex);
-    for (int index = info.lowIndex; index < info.highIndex; index++) {
-        int i = index % scene.width;
-        int j = index / scene.width;
 #ifdef ANTI_ALIASING
-        // anti-aliasing, generate random ray inside one pixel.
-        // should set random ray each spp loop, otherwise well get jagged edge
-        float pixel_width = 2.0f * imageAspectRatio * scale / scene.width;
-        float pixel_height = -2.0f * scale / scene.height;
-        float x = (2.0f * i / (float)scene.width - 1) * imageAspectRatio * scale;
-        float y = (1 - 2.0f * j / (float)scene.height) * scale;
-        for (int k = 0; k < info.spp; k++) {
-            Vector3f dir = normalize(Vector3f(-(x + pixel_width * get_random_float()), y + pixel_height * get_random_float(), 1));
-             info.bufferRef[index] += scene.castRay(Ray(info.eye_pos, dir), 0) / info.spp;
-        }
+    // anti-aliasing, generate random ray inside one pixel.
+    // should set random ray each spp loop, otherwise well get jagged edge
+    float pixel_width = 2.0f * imageAspectRatio * scale / scene.width;
+    float pixel_height = -2.0f * scale / scene.height;
+    float x = (2.0f * i / (float)scene.width - 1) * imageAspectRatio * scale;
+    float y = (1 - 2.0f * j / (float)scene.height) * scale;
+    Vector2f jitter = sampler.get2D();
+    Vector3f dir = normalize(Vector3f(-(x + pixel_width * jitter.x), y + pixel_height * jitter.y, 1));
 #else
-        float x = (2 * (i + 0.5f) / (float)scene.width - 1) * imageAspectRatio * scale;
-        float y = (1 - 2 * (j + 0.5f) / (float)scene.height) * scale;
-        Vector3f dir = normalize(Vector3f(-x, y, 1));
-        for (int k = 0; k < info.spp; k++) {
-             info.bufferRef[index] += scene.castRay(Ray(info.eye_pos, dir), 0) / info.spp;
-        }
+    float x = (2 * (i + 0.5f) / (float)scene.width - 1) * imageAspectRatio * scale;
+    float y = (1 - 2 * (j + 0.5f) / (float)scene.height) * scale;
+    Vector3f dir = normalize(Vector3f(-x, y, 1));
 #endif
-        float step = 0.05f * (info.highIndex - info.lowIndex);
-        if (displayProgress) {
-            if(index - last >= step) {
-                last = index;
-                printf("rendering...%.2f%%\n", 100 * float(index - info.lowIndex) / (info.highIndex - info.lowIndex));
+    return Ray(eye_pos, dir);
+}
+
+void Renderer::RenderTile(const ImageTile& tile, const MonotaskInfo& info, const Scene& scene) {
+    if (packet_size > 0)
+        return RenderTilePackets(tile, info, scene);
+    for (int j = tile.y0; j < tile.y1; j++) {
+        for (int i = tile.x0; i < tile.x1; i++) {
+            int index = j * scene.width + i;
+            for (int k = 0; k < info.spp; k++) {
+                Sampler sampler(sampler_type, info.spp);
+                sampler.startPixelSample(index, sample_offset + k);
+                Ray ray = CameraRay(scene, info.eye_pos, i, j, sampler);
+                info.bufferRef[index] += scene.castRay(ray, 0, sampler) / info.spp;
+            }
+        }
+    }
+}
+
+// The tile is cut into 4 x (packet_size / 4) pixel blocks. Each sample pass traces one camera
+// ray per pixel of a block as a packet: neighbouring rays visit mostly the same nodes, so the
+// packet shares node fetches and culls whole subtrees with one interval test. Only the first
+// hit is found this way, the rest of every path is traced by castRay as usual.
+void Renderer::RenderTilePackets(const ImageTile& tile, const MonotaskInfo& info, const Scene& scene) {
+    int size = std::min(std::max(packet_size, 4), kMaxRayPacket);
+    int blockWidth = 4, blockHeight = size / 4;
+    Ray rays[kMaxRayPacket];
+    HitRecord hits[kMaxRayPacket];
+    Sampler samplers[kMaxRayPacket];
+    int pixels[kMaxRayPacket];
+    std::fill(samplers, samplers + kMaxRayPacket, Sampler(sampler_type, info.spp));
+    for (int y0 = tile.y0; y0 < tile.y1; y0 += blockHeight) {
+        for (int x0 = tile.x0; x0 < tile.x1; x0 += blockWidth) {
+            for (int k = 0; k < info.spp; k++) {
+                int n = 0;
+                for (int j = y0; j < std::min(y0 + blockHeight, tile.y1); j++) {
+                    for (int i = x0; i < std::min(x0 + blockWidth, tile.x1); i++) {
+                        pixels[n] = j * scene.width + i;
+                        samplers[n].startPixelSample(pixels[n], sample_offset + k);
+                        rays[n] = CameraRay(scene, info.eye_pos, i, j, samplers[n]);
+                        hits[n] = HitRecord(rays[n].t_max);
+                        n++;
+                    }
+                }
+                uint32_t found = scene.intersectPacket(rays, n, hits);
+                for (int r = 0; r < n; r++) {
+                    Intersection hit = (found >> r) & 1 ? scene.finalize(rays[r], hits[r]) : Intersection();
+                    info.bufferRef[pixels[r]] += scene.castRay(rays[r], hit, 0, samplers[r]) / info.spp;
+                }
+            }
+        }
+    }
+}
+
+namespace {
+// what Scene::castRay keeps on its stack between two bounces
+struct WavefrontPath {
+    Ray ray;
+    Vector3f throughput;
+    float bsdfPdf;  // pdf of the BSDF sample that produced ray, 0 for camera rays
+    int depth;
+    int pixel;
+    int tile;       // index into the tiles in flight of the owning thread
+    Sampler sampler;
+};
+
+// light sample waiting for its visibility test, radiance already includes the path throughput
+struct ShadowQuery {
+    Ray ray;
+    Vector3f radiance;
+    int pixel;
+};
+
+struct TileWork {
+    ImageTile tile;
+    int nextSample;  // camera samples handed out so far, pixel-major
+    int alive;       // paths of this tile still in the pool
+};
+}
+
+// Wavefront path tracing: instead of following one path to its end, the thread keeps a pool
+// of paths and advances all of them one bounce per pass. Each pass traces every extension ray,
+// handles misses and emitters, shades the remaining hits grouped by material type (so one
+// material's eval/sample code and data stay hot), then traces the shadow rays it queued. Paths
+// that end free their slot, which is refilled with the next camera sample right away, pulling
+// new tiles from the scheduler, so the pool stays full until the image runs out. The estimator
+// is the one of Scene::castRay, only the order of the work differs.
+void Renderer::WavefrontMonotask(MonotaskInfo info, const Scene& scene, bool displayProgress) {
+    int poolSize = std::max(1, wavefront_size);
+    float pixel_weight = 1.0f / (scene.width * scene.height);
+    std::vector<WavefrontPath> paths(poolSize);
+    for (WavefrontPath& path : paths)
+        path.sampler = Sampler(sampler_type, info.spp);
+    std::vector<Intersection> hits(poolSize);
+    std::vector<int> freeSlots(poolSize);
+    std::iota(freeSlots.rbegin(), freeSlots.rend(), 0);
+    std::vector<int> active, extended, shade;
+    std::vector<ShadowQuery> shadows;
+    std::vector<TileWork> tiles;
+    size_t firstOpen = 0;  // tiles before it are completed
+    bool exhausted = false;
+
+    auto finish = [&](int slot) {
+        tiles[paths[slot].tile].alive--;
+        freeSlots.push_back(slot);
+    };
+
+    for (;;) {
+        // regenerate: every free slot starts a new camera path
+        while (!freeSlots.empty() && !exhausted) {
+            if (tiles.size() == firstOpen ||
+                tiles.back().nextSample == tiles.back().tile.pixelCount() * info.spp) {
+                ImageTile tile;
+                if (!info.scheduler.next(info.threadIndex, tile)) {
+                    exhausted = true;
+                    break;
+                }
+                tiles.push_back({ tile, 0, 0 });
+                continue;
+            }
+            TileWork& work = tiles.back();
+            int p = work.nextSample / info.spp, k = work.nextSample++ % info.spp;
+            int tileWidth = work.tile.x1 - work.tile.x0;
+            int i = work.tile.x0 + p % tileWidth, j = work.tile.y0 + p / tileWidth;
+            int slot = freeSlots.back();
+            freeSlots.pop_back();
+            WavefrontPath& path = paths[slot];
+            path.sampler.startPixelSample(j * scene.width + i, sample_offset + k);
+            path.ray = CameraRay(scene, info.eye_pos, i, j, path.sampler);
+            path.throughput = Vector3f(1);
+            path.bsdfPdf = 0;
+            path.depth = 0;
+            path.pixel = j * scene.width + i;
+            path.tile = (int)tiles.size() - 1;
+            work.alive++;
+            active.push_back(slot);
+        }
+        if (active.empty())
+            break;
+
+        // extension rays
+        for (int slot : active)
+            hits[slot] = scene.intersect(paths[slot].ray);
+
+        // misses and emitters end their paths, the rest waits for shading
+        shade.clear();
+        for (int slot : active) {
+            WavefrontPath& path = paths[slot];
+            const Intersection& hit = hits[slot];
+            if (!hit.happened) {
+                finish(slot);
+            } else if (hit.m->hasEmission()) {
+                info.bufferRef[path.pixel] +=
+                    path.throughput * scene.emittedRadiance(path.ray, hit, path.bsdfPdf) / info.spp;
+                finish(slot);
+            } else if (path.depth >= scene.maxDepth) {
+                finish(slot);
+            } else {
+                shade.push_back(slot);
+            }
+        }
+        std::stable_sort(shade.begin(), shade.end(),
+                         [&](int a, int b) { return hits[a].m->m_type < hits[b].m->m_type; });
+
+        // shading queues a shadow ray and the next extension ray of every path
+        extended.clear();
+        shadows.clear();
+        for (int slot : shade) {
+            WavefrontPath& path = paths[slot];
+            const Intersection& hit = hits[slot];
+            Vector3f wo = -path.ray.direction;
+            ShadowQuery query;
+            if (scene.sampleDirect(hit, wo, path.depth, query.ray, query.radiance, path.sampler)) {
+                query.radiance = path.throughput * query.radiance;
+                query.pixel = path.pixel;
+                shadows.push_back(query);
+            }
+            if (scene.sampleBounce(hit, wo, path.depth, path.throughput, path.bsdfPdf, path.ray, path.sampler)) {
+                path.depth++;
+                extended.push_back(slot);
+            } else {
+                finish(slot);
+            }
+        }
+
+        for (const ShadowQuery& query : shadows) {
+            if (!scene.occluded(query.ray))
+                info.bufferRef[query.pixel] += query.radiance / info.spp;
+        }
+        std::swap(active, extended);
+
+        // a tile is done once all its samples were handed out and their paths ended
+        for (; firstOpen < tiles.size(); firstOpen++) {
+            const TileWork& work = tiles[firstOpen];
+            if (work.alive > 0 || work.nextSample < work.tile.pixelCount() * info.spp)
+                break;
+            float progress = info.scheduler.complete(work.tile);
+            float previous = progress - work.tile.pixelCount() * pixel_weight;
+            if (displayProgress && int(progress * 20) > int(previous * 20)) {
+                printf("rendering...%.2f%%\n", 100 * progress);
             }
-            // UpdateProgress(float(index - info.lowIndex) / (info.highIndex - info.lowIndex));
         }
     }
 }
@@ -107,7 +532,6 @@ void Renderer::Render(const Scene& scene) {
 
     float scale = tan(deg2rad(scene.fov * 0.5));
     float imageAspectRatio = scene.width / (float)scene.height;
-    Vector3f eye_pos(278, 273, -800);
     int m = 0;
 
     // change the spp value to change sample ammount
@@ -121,7 +545,9 @@ void Renderer::Render(const Scene& scene) {
 
             Vector3f dir = normalize(Vector3f(-x, y, 1));
             for (int k = 0; k < spp; k++) {
-                framebuffer[m] += scene.castRay(Ray(eye_pos, dir), 0) / spp;
+                Sampler sampler(sampler_type, spp);
+                sampler.startPixelSample(m, sample_offset + k);
+                framebuffer[m] += scene.castRay(Ray(eye_pos, dir), 0, sampler) / spp;
             }
             m++;
         }
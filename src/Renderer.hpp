@@ -1,4 +1,8 @@
 #include "Scene.hpp"
+#include "TileScheduler.hpp"
+#include "Film.hpp"
+#include <chrono>
+#include <string>
 
 #pragma once
 struct hit_payload {
@@ -9,18 +13,19 @@ struct hit_payload {
 };
 
 struct MonotaskInfo {
-    int lowIndex, highIndex;
+    int threadIndex;
     Vector3f eye_pos;
     int spp;
     std::vector<Vector3f>& bufferRef;
+    TileScheduler& scheduler;
 
-    MonotaskInfo() = default;
-    MonotaskInfo(int low_index, int high_index, const Vector3f& eye_pos, int spp, std::vector<Vector3f>& buffer_ref)
-        : lowIndex(low_index),
-        highIndex(high_index),
+    MonotaskInfo(int thread_index, const Vector3f& eye_pos, int spp, std::vector<Vector3f>& buffer_ref,
+        TileScheduler& scheduler)
+        : threadIndex(thread_index),
         eye_pos(eye_pos),
         spp(spp),
-        bufferRef(buffer_ref) {}
+        bufferRef(buffer_ref),
+        scheduler(scheduler) {}
 
 };
 
@@ -28,9 +33,55 @@ class Renderer {
 public:
     int spp = 16;
     int num_of_thread = 12;
+    int tile_size = 32;
+    // paths every thread keeps in flight when rendering wavefront style, 0 renders pixel by pixel
+    int wavefront_size = 0;
+    // camera rays traced together as one BVH packet (8 or 16, 4 pixels wide), 0 traces them one by one
+    int packet_size = 0;
+    // how the random decisions of a pixel's samples are spread, see Sampler.hpp
+    SamplerType sampler_type = SamplerType::SOBOL;
+    // adaptive sampling: relative error pixels are refined towards within the budget of spp
+    // samples per pixel on average, 0 renders spp samples in every pixel
+    float adaptive_threshold = 0;
+    // with adaptive sampling, also save a map of the samples every pixel received
+    bool save_sample_map = false;
+    // progressive rendering: wall-clock budget in seconds and target mean relative error, the
+    // render stops at whichever is reached first (or at spp samples per pixel); 0 disables one
+    float time_budget = 0;
+    float noise_target = 0;
+    // largest pass of progressive rendering, in samples per pixel
+    int max_pass_spp = 16;
+    // progressive rendering: film file (Film::save) written in the background after any pass
+    // that ends checkpoint_interval seconds or more after the last one, and once at the end;
+    // empty disables checkpoints
+    std::string checkpoint_path;
+    float checkpoint_interval = 60;
+    // progressive rendering: film file to continue from instead of starting with an empty film
+    std::string resume_path;
+    // first sample index of every pixel; renders with disjoint ranges of sample indices are
+    // independent and their film files can be merged (Film::merge)
+    uint32_t sample_offset = 0;
+    Vector3f eye_pos = Vector3f(278, 273, -800);
     void RenderMonotask(MonotaskInfo info, const Scene& scene, bool displayProgress = false);
+    void RenderTile(const ImageTile& tile, const MonotaskInfo& info, const Scene& scene);
+    void RenderTilePackets(const ImageTile& tile, const MonotaskInfo& info, const Scene& scene);
+    // same work as RenderMonotask, but bounce by bounce over a pool of wavefront_size paths
+    void WavefrontMonotask(MonotaskInfo info, const Scene& scene, bool displayProgress = false);
+    // camera ray through pixel (i, j), jittered inside the pixel with ANTI_ALIASING
+    Ray CameraRay(const Scene& scene, const Vector3f& eye_pos, int i, int j, Sampler& sampler) const;
     void Render(const Scene& scene);
     void RenderMultithread(const Scene& scene);
+    using Deadline = std::chrono::steady_clock::time_point;
+    // adds samples[p] samples to pixel p of film, continuing the pixel's sample indices; tiles
+    // not started by the deadline are left out, false if there were any
+    bool RenderPass(const Scene& scene, Film& film, const std::vector<int>& samples,
+                    Deadline deadline = Deadline::max());
+    void RenderPassMonotask(int threadIndex, TileScheduler& scheduler, const Scene& scene, Film& film,
+                            const std::vector<int>& samples, Deadline deadline);
+    void RenderProgressive(const Scene& scene);
+    void RenderAdaptive(const Scene& scene);
+    // samples per pixel as gray levels, the brightest pixel got the most
+    void SaveSampleMap(const char* filename, const Film& film) const;
     void SavePPM(const char* filename, int width, int height, std::vector<Vector3f>& framebuffer) const;
 private:
 };
@@ -0,0 +1,223 @@
+#ifndef RAYTRACING_SAMPLER_H
+#define RAYTRACING_SAMPLER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "Vector.hpp"
+
+// pcg4d (Jarzynski and Olano, "Hash Functions for GPU Rendering", 2020): four rounds of LCG
+// and cross-multiplication mixing, good enough to be used directly as random numbers
+inline uint32_t pcg4dHash(uint32_t x, uint32_t y, uint32_t z, uint32_t w) {
+    x = x * 1664525u + 1013904223u;
+    y = y * 1664525u + 1013904223u;
+    z = z * 1664525u + 1013904223u;
+    w = w * 1664525u + 1013904223u;
+    x += y * w; y += z * x; z += x * y; w += y * z;
+    x ^= x >> 16; y ^= y >> 16; z ^= z >> 16; w ^= w >> 16;
+    x += y * w; y += z * x; z += x * y; w += y * z;
+    return x ^ y ^ z ^ w;
+}
+
+// top 24 bits as a float in [0, 1)
+inline float hashToUnitFloat(uint32_t bits) { return (bits >> 8) * 0x1p-24f; }
+
+inline uint32_t reverseBits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Owen scrambling of the bits of x, hash based (Burley, "Practical Hash-based Owen Scrambling",
+// 2020): every bit is flipped depending on the seed and the bits above it
+inline uint32_t owenScramble(uint32_t x, uint32_t seed) {
+    x = reverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverseBits(x);
+}
+
+// first two dimensions of the Sobol sequence as 32-bit fractions: van der Corput and the one
+// generated by x + 1, whose direction numbers follow v_i = v_{i-1} ^ (v_{i-1} >> 1)
+inline uint32_t sobolSample(uint32_t index, int dim) {
+    if (dim == 0)
+        return reverseBits(index);
+    uint32_t x = 0, v = 0x80000000u;
+    for (; index; index >>= 1, v ^= v >> 1) {
+        if (index & 1)
+            x ^= v;
+    }
+    return x;
+}
+
+// Kensler's hashed permutation of [0, l) ("Correlated Multi-Jittered Sampling", 2013), i -> place of i
+inline uint32_t permuteIndex(uint32_t i, uint32_t l, uint32_t p) {
+    uint32_t w = l - 1;
+    w |= w >> 1; w |= w >> 2; w |= w >> 4; w |= w >> 8; w |= w >> 16;
+    do {
+        i ^= p; i *= 0xe170893du; i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8; i *= 0x0929eb3fu; i ^= p >> 23;
+        i ^= (i & w) >> 1; i *= 1 | p >> 27;
+        i *= 0x6935fa69u; i ^= (i & w) >> 11;
+        i *= 0x74dcb303u; i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u; i ^= (i & w) >> 2;
+        i *= 0xc860a3dfu; i &= w; i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+}
+
+// radical inverse of a in the given prime base, the Halton sequence's coordinate for that base
+inline float radicalInverse(uint32_t base, uint32_t a) {
+    double invBase = 1.0 / base, invBaseN = 1;
+    uint64_t reversed = 0;
+    while (a) {
+        uint32_t next = a / base;
+        reversed = reversed * base + (a - next * base);
+        invBaseN *= invBase;
+        a = next;
+    }
+    return std::min(float(reversed * invBaseN), 0x1.fffffep-1f);
+}
+
+// the n-th prime, n < 1024
+inline uint32_t nthPrime(int n) {
+    static const std::vector<uint32_t> primes = [] {
+        std::vector<uint32_t> p;
+        for (uint32_t c = 2; p.size() < 1024; c++) {
+            bool prime = true;
+            for (uint32_t q : p) {
+                if (q * q > c) break;
+                if (c % q == 0) { prime = false; break; }
+            }
+            if (prime) p.push_back(c);
+        }
+        return p;
+    }();
+    return primes[n];
+}
+
+// INDEPENDENT: uniform random numbers, no correlation between samples
+// STRATIFIED: jittered strata over the pixel's samples, strata shuffled per dimension
+// HALTON: Halton points in the pixel's sample index, randomized by a per-pixel toroidal shift
+// SOBOL: (0, 2)-sequence in every pair of dimensions, Owen scrambled, with the sample index
+//        shuffled per dimension so pairs do not correlate with each other
+enum class SamplerType { INDEPENDENT, STRATIFIED, HALTON, SOBOL };
+
+// Random numbers for one camera sample. Every value is a function of the pixel, the sample's
+// index within the pixel and its dimension, computed on demand, so it does not depend on
+// which thread renders the sample or when: the image is the same for any thread count or tile
+// schedule, and the state is small enough to keep one per path in flight.
+//
+// A dimension is one get1D or get2D call. The path tracer lays them out in fixed blocks, the
+// camera jitter first and then one block per bounce, and moves to the start of a decision's
+// slot with setDimension, so a decision always reads the same dimension in every sample even
+// when the decisions before it drew a varying number of values. That is what lets the
+// stratified and low-discrepancy types spread each decision evenly over the pixel's samples.
+class Sampler {
+public:
+    // dimension layout of a path
+    static constexpr int kCameraDimension = 0;
+    enum BounceDimension { BOUNCE_LIGHT = 0, BOUNCE_BSDF = 4, BOUNCE_ROULETTE = 5, kBounceDimensions = 6 };
+    static int bounceDimension(int depth, BounceDimension offset) {
+        return kCameraDimension + 1 + depth * kBounceDimensions + offset;
+    }
+
+    // samplesPerPixel sizes the strata of STRATIFIED, the other types work for any sample count
+    explicit Sampler(SamplerType type = SamplerType::INDEPENDENT, int samplesPerPixel = 1, uint32_t seed = 0)
+        : type(type), samplesPerPixel(std::max(1, samplesPerPixel)), seed(seed) {}
+
+    // restart at dimension 0 of sample sampleIndex of pixel
+    void startPixelSample(uint32_t pixel, uint32_t sampleIndex) {
+        this->pixel = pixel;
+        this->sampleIndex = sampleIndex;
+        dimension = 0;
+    }
+    void setDimension(int d) { dimension = d; }
+
+    inline float get1D();
+    inline Vector2f get2D();
+
+    SamplerType type;
+    int samplesPerPixel;
+    uint32_t seed;
+
+private:
+    // hash of the current pixel and dimension, plus salt for several values per dimension
+    uint32_t dimensionHash(uint32_t salt) const { return pcg4dHash(pixel, dimension, salt, seed); }
+    float uniform(uint32_t salt) const {
+        return hashToUnitFloat(pcg4dHash(pixel, sampleIndex, dimension * 4 + salt, seed));
+    }
+
+    uint32_t pixel = 0, sampleIndex = 0;
+    int dimension = 0;
+};
+
+float Sampler::get1D() {
+    float u;
+    switch (type) {
+    case SamplerType::STRATIFIED: {
+        uint32_t stratum = permuteIndex(sampleIndex % samplesPerPixel, samplesPerPixel, dimensionHash(0));
+        u = (stratum + uniform(0)) / samplesPerPixel;
+        break;
+    }
+    case SamplerType::HALTON:
+        if (2 * dimension < 1024) {
+            u = radicalInverse(nthPrime(2 * dimension), sampleIndex) + hashToUnitFloat(dimensionHash(0));
+            u -= std::floor(u);
+            break;
+        }
+        u = uniform(0);
+        break;
+    case SamplerType::SOBOL: {
+        uint32_t index = owenScramble(sampleIndex, dimensionHash(0));
+        u = hashToUnitFloat(owenScramble(sobolSample(index, 0), dimensionHash(1)));
+        break;
+    }
+    default:
+        u = uniform(0);
+    }
+    dimension++;
+    return std::min(u, 0x1.fffffep-1f);
+}
+
+Vector2f Sampler::get2D() {
+    Vector2f u;
+    switch (type) {
+    case SamplerType::STRATIFIED: {
+        int nx = std::max(1, (int)std::sqrt((float)samplesPerPixel));
+        int ny = (samplesPerPixel + nx - 1) / nx;
+        uint32_t cell = permuteIndex(sampleIndex % samplesPerPixel, nx * ny, dimensionHash(0));
+        u = Vector2f((cell % nx + uniform(0)) / nx, (cell / nx + uniform(1)) / ny);
+        break;
+    }
+    case SamplerType::HALTON:
+        if (2 * dimension + 1 < 1024) {
+            u = Vector2f(radicalInverse(nthPrime(2 * dimension), sampleIndex) + hashToUnitFloat(dimensionHash(0)),
+                         radicalInverse(nthPrime(2 * dimension + 1), sampleIndex) + hashToUnitFloat(dimensionHash(1)));
+            u = Vector2f(u.x - std::floor(u.x), u.y - std::floor(u.y));
+            break;
+        }
+        u = Vector2f(uniform(0), uniform(1));
+        break;
+    case SamplerType::SOBOL: {
+        uint32_t index = owenScramble(sampleIndex, dimensionHash(0));
+        u = Vector2f(hashToUnitFloat(owenScramble(sobolSample(index, 0), dimensionHash(1))),
+                     hashToUnitFloat(owenScramble(sobolSample(index, 1), dimensionHash(2))));
+        break;
+    }
+    default:
+        u = Vector2f(uniform(0), uniform(1));
+    }
+    dimension++;
+    return Vector2f(std::min(u.x, 0x1.fffffep-1f), std::min(u.y, 0x1.fffffep-1f));
+}
+
+#endif //RAYTRACING_SAMPLER_H
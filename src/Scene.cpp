@@ -1,32 +1,225 @@
 #include "Scene.hpp"
+#include "Sphere.hpp"
+#include <algorithm>
+
+// lights are picked proportional to their area, the list is fixed when the BVH is built
+static void collectEmitters(const std::vector<Object*>& objects, std::vector<Object*>& emitters,
+                            std::vector<float>& areaCdf) {
+    emitters.clear();
+    areaCdf.clear();
+    float areaSum = 0;
+    for (Object* obj : objects) {
+        if (obj->hasEmit()) {
+            areaSum += obj->getArea();
+            emitters.push_back(obj);
+            areaCdf.push_back(areaSum);
+        }
+    }
+}
 
 void Scene::buildBVH() {
     printf(" - Generating BVH...\n\n");
-    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+    compiledPrimitives.clear();
+    compiledIndex.clear();
+    compiledTriangles.clear();
+    compiledSpheres.clear();
+    collectEmitters(objects, emitters, emitterAreaCdf);
+    // only the top level is rebuilt, meshes and the prototypes of instances keep their own BVHs
+    for (Object* obj : objects)
+        obj->buildAccel();
+    delete this->bvh;
+    this->bvh = new BVHAccel(objects, maxPrimsInNode, splitMethod, nodeLayout);
+}
+
+void Scene::compile() {
+    printf(" - Compiling scene into a single BVH...\n\n");
+    collectEmitters(objects, emitters, emitterAreaCdf);
+    std::vector<PrimitiveRef> refs;
+    std::vector<Bounds3> primBounds;
+    std::vector<uint8_t> primTypes;
+    std::vector<std::array<Vector3f, 3>> triangles; // vertices of the PRIM_TRIANGLE refs, by ref
+    for (Object* obj : objects) {
+        bool isSphere = dynamic_cast<Sphere*>(obj) != nullptr;
+        int n = obj->primitiveCount();
+        for (int i = 0; i < n; ++i) {
+            std::array<Vector3f, 3> v;
+            bool isTriangle = obj->primitiveTriangle(i, v[0], v[1], v[2]);
+            // generic primitives are intersected through the object, which needs its own BVH
+            if (!isTriangle && !isSphere && i == 0)
+                obj->buildAccel();
+            refs.push_back({ obj, i });
+            primBounds.push_back(obj->primitiveBounds(i));
+            primTypes.push_back(isTriangle ? PRIM_TRIANGLE : isSphere ? PRIM_SPHERE : PRIM_OBJECT);
+            triangles.push_back(v);
+        }
+    }
+    delete this->bvh;
+    this->bvh = new BVHAccel(primBounds, maxPrimsInNode, splitMethod, nodeLayout, primTypes);
+    const std::vector<int>& order = bvh->primitiveOrder();
+    compiledPrimitives.resize(refs.size());
+    compiledIndex.resize(refs.size());
+    compiledTriangles.clear();
+    compiledSpheres.clear();
+    // the typed arrays are filled in slot order, which keeps every leaf contiguous in its array
+    constexpr int W = kTrianglePacketWidth;
+    int nTriangles = 0;
+    for (size_t i = 0; i < refs.size(); ++i) {
+        compiledPrimitives[i] = refs[order[i]];
+        switch (primTypes[order[i]]) {
+        case PRIM_TRIANGLE: {
+            compiledIndex[i] = nTriangles;
+            if (nTriangles % W == 0)
+                compiledTriangles.emplace_back();
+            const std::array<Vector3f, 3>& v = triangles[order[i]];
+            compiledTriangles.back().setTriangle(nTriangles % W, v[0], v[1], v[2]);
+            nTriangles++;
+            break;
+        }
+        case PRIM_SPHERE:
+            compiledIndex[i] = (int)compiledSpheres.size();
+            compiledSpheres.push_back(static_cast<Sphere*>(compiledPrimitives[i].object));
+            break;
+        default:
+            compiledIndex[i] = (int)i;
+        }
+    }
 }
 
 Intersection Scene::intersect(const Ray &ray) const {
-    return this->bvh->Intersect(ray);
+    HitRecord hit(ray.t_max);
+    if (!intersect(ray, hit))
+        return Intersection();
+    return finalize(ray, hit);
 }
 
-void Scene::sampleLight(Intersection &pos, float &pdf) const {
-    float emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()) {
-            emit_area_sum += objects[k]->getArea();
+bool Scene::intersect(const Ray &ray, HitRecord &hit) const {
+    if (compiledPrimitives.empty())
+        return this->bvh->Intersect(ray, hit);
+    bool found = false;
+    WideRay wideRay(ray);
+    bvh->traverse(ray, hit.t, [&](int first, int count, int type, float& tMax) {
+        found |= intersectLeaf(ray, wideRay, first, count, type, hit);
+        tMax = hit.t;
+    });
+    return found;
+}
+
+bool Scene::intersectLeaf(const Ray &ray, const WideRay &wideRay, int first, int count, int type,
+                          HitRecord &hit) const {
+    int base = compiledIndex[first];
+    bool found = false;
+    switch (type) {
+    case PRIM_TRIANGLE: {
+        constexpr int W = kTrianglePacketWidth;
+        for (int p = base / W; p * W < base + count; ++p) {
+            int lane = compiledTriangles[p].closestHit(wideRay, packetLaneMask<W>(p, base, count), hit.t,
+                                                       hit.u, hit.v);
+            if (lane >= 0) {
+                hit.instId = first + p * W + lane - base;
+                hit.primId = compiledPrimitives[hit.instId].index;
+                found = true;
+            }
         }
+        break;
     }
-    float p = get_random_float() * emit_area_sum;
-    emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()) {
-            emit_area_sum += objects[k]->getArea();
-            if (p <= emit_area_sum) {
-                objects[k]->Sample(pos, pdf);
-                break;
+    case PRIM_SPHERE:
+        for (int i = 0; i < count; ++i) {
+            float t;
+            if (compiledSpheres[base + i]->hit(ray, hit.t, t)) {
+                hit.t = t;
+                hit.instId = first + i;
+                hit.primId = 0;
+                found = true;
+            }
+        }
+        break;
+    default:
+        for (int i = first; i < first + count; ++i) {
+            const PrimitiveRef& prim = compiledPrimitives[i];
+            if (prim.object->intersectPrimitive(prim.index, ray, hit)) {
+                hit.instId = i;
+                found = true;
             }
         }
     }
+    return found;
+}
+
+uint32_t Scene::intersectPacket(const Ray *rays, int n, HitRecord *hits) const {
+    uint32_t found = 0;
+    if (!compiledPrimitives.empty()) {
+        WideRay wideRays[kMaxRayPacket];
+        float tMax[kMaxRayPacket];
+        for (int i = 0; i < n; i++) {
+            wideRays[i] = WideRay(rays[i]);
+            tMax[i] = hits[i].t;
+        }
+        bool traced = bvh->traversePacket(rays, n, tMax, [&](int first, int count, int type, uint32_t mask) {
+            for (; mask; mask &= mask - 1) {
+                int i = __builtin_ctz(mask);
+                if (intersectLeaf(rays[i], wideRays[i], first, count, type, hits[i]))
+                    found |= 1u << i;
+                tMax[i] = hits[i].t;
+            }
+        });
+        if (traced)
+            return found;
+    }
+    for (int i = 0; i < n; i++) {
+        if (intersect(rays[i], hits[i]))
+            found |= 1u << i;
+    }
+    return found;
+}
+
+Intersection Scene::finalize(const Ray &ray, const HitRecord &hit) const {
+    if (compiledPrimitives.empty())
+        return bvh->primitives[hit.instId]->finalize(ray, hit);
+    return compiledPrimitives[hit.instId].object->finalize(ray, hit);
+}
+
+bool Scene::occluded(const Ray &ray) const {
+    if (compiledPrimitives.empty())
+        return this->bvh->IntersectP(ray);
+    WideRay wideRay(ray);
+    return bvh->traverseAny(ray, [&](int first, int count, int type) {
+        int base = compiledIndex[first];
+        switch (type) {
+        case PRIM_TRIANGLE: {
+            constexpr int W = kTrianglePacketWidth;
+            for (int p = base / W; p * W < base + count; ++p)
+                if (compiledTriangles[p].anyHit(wideRay, packetLaneMask<W>(p, base, count), ray.t_max))
+                    return true;
+            return false;
+        }
+        case PRIM_SPHERE:
+            for (int i = 0; i < count; ++i) {
+                float t;
+                if (compiledSpheres[base + i]->hit(ray, ray.t_max, t))
+                    return true;
+            }
+            return false;
+        default:
+            for (int i = first; i < first + count; ++i) {
+                const PrimitiveRef& prim = compiledPrimitives[i];
+                if (prim.object->primitiveOccluded(prim.index, ray))
+                    return true;
+            }
+            return false;
+        }
+    });
+}
+
+void Scene::sampleLight(Intersection &pos, float &pdf, Sampler &sampler) const {
+    if (emitters.empty())
+        return;
+    float p = sampler.get1D() * emitterAreaCdf.back();
+    size_t k = std::min(size_t(std::upper_bound(emitterAreaCdf.begin(), emitterAreaCdf.end(), p) -
+                               emitterAreaCdf.begin()),
+                        emitters.size() - 1);
+    emitters[k]->Sample(pos, pdf, sampler);
+    // times the probability of having picked this emitter
+    pdf *= (emitterAreaCdf[k] - (k > 0 ? emitterAreaCdf[k - 1] : 0)) / emitterAreaCdf.back();
 }
 
 bool Scene::trace(const Ray &ray, const std::vector<Object *> &objects,
@@ -45,52 +238,99 @@ bool Scene::trace(const Ray &ray, const std::vector<Object *> &objects,
     return (*hitObject != nullptr);
 }
 
-// Implementation of Path Tracing
-Vector3f Scene::castRay(const Ray &ray, int depth) const {
-    // TO DO Implement Path Tracing Algorithm here
-    // caculate light_direct
-    Intersection inter_object;
-    Vector3f color(0);
-    Vector3f L_dir(0), L_indir(0);
-    inter_object = intersect(ray);
-    if(inter_object.emit.norm() > 0.001) {
-        return Vector3f(1);
+// power heuristic weight of a sample drawn with pdf fPdf, when gPdf could also have produced it
+static float powerHeuristic(float fPdf, float gPdf) {
+    float f = fPdf * fPdf, g = gPdf * gPdf;
+    return f / (f + g);
+}
+
+Vector3f Scene::emittedRadiance(const Ray &ray, const Intersection &hit, float bsdfPdf) const {
+    if (bsdfPdf == 0)
+        return hit.emit;
+    float cosLight = dotProduct(-ray.direction, hit.normal);
+    if (cosLight <= 0 || emitters.empty())
+        return Vector3f(0);
+    float lightPdf = hit.distance * hit.distance / (cosLight * emitterAreaCdf.back());
+    return hit.emit * powerHeuristic(bsdfPdf, lightPdf);
+}
+
+bool Scene::sampleDirect(const Intersection &hit, const Vector3f &wo, int depth, Ray &shadowRay,
+                         Vector3f &radiance, Sampler &sampler) const {
+    Intersection inter_light;
+    float pdf_light = 0;
+    sampler.setDimension(Sampler::bounceDimension(depth, Sampler::BOUNCE_LIGHT));
+    sampleLight(inter_light, pdf_light, sampler);
+    if (!(pdf_light > 0))
+        return false;
+    Vector3f toLight = inter_light.coords - hit.coords;
+    float dist2 = dotProduct(toLight, toLight);
+    Vector3f ws = toLight / std::sqrt(dist2);
+    float cosLight = dotProduct(-ws, inter_light.normal);
+    float cosSurface = dotProduct(ws, hit.normal);
+    if (cosLight <= 0 || cosSurface <= 0)
+        return false;
+    float lightPdf = pdf_light * dist2 / cosLight;
+    radiance = inter_light.emit * hit.m->eval(ws, wo, hit.normal) * cosSurface *
+               powerHeuristic(lightPdf, hit.m->pdf(ws, wo, hit.normal)) / lightPdf;
+    // both ends are offset off their surfaces, the ray stops just short of the light sample
+    shadowRay = hit.spawnRayTo(inter_light);
+    return true;
+}
+
+bool Scene::sampleBounce(const Intersection &hit, const Vector3f &wo, int depth, Vector3f &throughput,
+                         float &bsdfPdf, Ray &next, Sampler &sampler) const {
+    Material *m = hit.m;
+    sampler.setDimension(Sampler::bounceDimension(depth, Sampler::BOUNCE_BSDF));
+    Vector3f wi = normalize(m->sample(wo, hit.normal, sampler));
+    float pdf = m->pdf(wi, wo, hit.normal);
+    float cosTheta = dotProduct(wi, hit.normal);
+    if (!(pdf > 0) || cosTheta <= 0)
+        return false;
+    throughput = throughput * m->eval(wi, wo, hit.normal) * cosTheta / pdf;
+    bsdfPdf = pdf;
+    if (depth + 1 > russianRouletteDepth) {
+        // the dimmer the path, the likelier it ends; survivors are scaled up to stay unbiased
+        float q = std::max(0.05f, 1 - std::max({ throughput.x, throughput.y, throughput.z }));
+        sampler.setDimension(Sampler::bounceDimension(depth, Sampler::BOUNCE_ROULETTE));
+        if (sampler.get1D() < q)
+            return false;
+        throughput = throughput / (1 - q);
     }
+    next = hit.spawnRay(wi);
+    return true;
+}
 
-    if (inter_object.happened) {
-        Intersection inter_light;
-        float pdf_light;
-        sampleLight(inter_light, pdf_light);
-        if(inter_light.emit.norm() < 0.001) {
-            return color;
-        }
-        Vector3f p = inter_object.coords;
-        Vector3f n = inter_object.normal;
-        Vector3f x = inter_light.coords;
-        Vector3f nn = inter_light.normal;
-        Vector3f ws = normalize(x - p);
-        Vector3f wo = -ray.direction;
-        Material *m = inter_object.m;
-        Vector3f f_r = m->eval(ws, wo, n);
-        if ((intersect(Ray(p, ws)).coords - x).norm() < 0.001) {
-            L_dir = inter_light.emit * f_r *
-                    std::max(dotProduct(-ws, nn), 0.0f) *
-                    std::max(dotProduct(ws, n), 0.0f) /
-                    dotProduct(x - p, x - p) /
-                    pdf_light;
-        }
+// Implementation of Path Tracing: one loop iteration per bounce, throughput is the product of
+// f * cos / pdf along the path so far. Emitters are reached both by light sampling at every
+// vertex and by BSDF-sampled rays that happen to hit one; the two are combined with multiple
+// importance sampling, so neither counts the same light twice.
+Vector3f Scene::castRay(const Ray &ray, int depth, Sampler &sampler) const {
+    return castRay(ray, intersect(ray), depth, sampler);
+}
 
-        //indirect light
-        if (get_random_float() < Scene::RussianRoulette) {
-            Vector3f wi = m->sample(wo, n);
-            Ray ray_reflect(p, wi);
-            f_r = m->eval(wi, wo, n);
-            Vector3f irradience = castRay(ray_reflect, depth);
-            L_indir = irradience * f_r * dotProduct(wi, n) / std::max(0.0001f, m->pdf(wi, wo, n)) / Scene::RussianRoulette;
+Vector3f Scene::castRay(const Ray &cameraRay, const Intersection &firstHit, int depth, Sampler &sampler) const {
+    Vector3f L(0), throughput(1);
+    Ray ray = cameraRay;
+    Intersection hit = firstHit;
+    // solid angle pdf of the BSDF sample that produced ray, 0 for the camera ray
+    float bsdfPdf = 0;
+    for (;; ++depth) {
+        if (!hit.happened)
+            break;
+        if (hit.m->hasEmission()) {
+            L += throughput * emittedRadiance(ray, hit, bsdfPdf);
+            break;
         }
-        color = L_dir + L_indir;
+        if (depth >= maxDepth)
+            break;
+        Vector3f wo = -ray.direction;
+        Ray shadowRay;
+        Vector3f direct;
+        if (sampleDirect(hit, wo, depth, shadowRay, direct, sampler) && !occluded(shadowRay))
+            L += throughput * direct;
+        if (!sampleBounce(hit, wo, depth, throughput, bsdfPdf, ray, sampler))
+            break;
+        hit = intersect(ray);
     }
-
-    // std::clog << "return (" << L_dir << ")+(" << L_indir << ")" << std::endl;
-    return Vector3f::Min(Vector3f::Max(color, Vector3f(0)), Vector3f(1));
+    return L;
 }
@@ -7,6 +7,9 @@
 #include "AreaLight.hpp"
 #include "BVH.hpp"
 #include "Ray.hpp"
+#include "TrianglePacket.hpp"
+
+class Sphere;
 
 
 class Scene
@@ -17,8 +20,14 @@ public:
     int height = 960;
     double fov = 40;
     Vector3f backgroundColor = Vector3f(0.235294, 0.67451, 0.843137);
-    int maxDepth = 1;
-    float RussianRoulette = 0.8;
+    // longest path in bounces: 0 only sees emitters, 1 adds direct lighting
+    int maxDepth = 16;
+    // bounces a path always survives, after that Russian roulette ends it based on its throughput
+    int russianRouletteDepth = 3;
+    BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::SAH;
+    BVHAccel::NodeLayout nodeLayout = BVHAccel::NodeLayout::BINARY;
+    // most primitives a BVH leaf of buildBVH/compile may hold
+    int maxPrimsInNode = 1;
 
     Scene(int w, int h) : width(w), height(h), bvh(nullptr)
     {}
@@ -29,10 +38,58 @@ public:
     const std::vector<Object*>& get_objects() const { return objects; }
     const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
     Intersection intersect(const Ray& ray) const;
+    // closest hit as a slim record, finalize builds the shading data for it
+    bool intersect(const Ray& ray, HitRecord& hit) const;
+    Intersection finalize(const Ray& ray, const HitRecord& hit) const;
+    // closest hits of n <= kMaxRayPacket rays traced as one packet, falling back to one by one
+    // when they are not coherent; returns the mask of rays that hit something
+    uint32_t intersectPacket(const Ray* rays, int n, HitRecord* hits) const;
+    bool occluded(const Ray& ray) const;
     BVHAccel *bvh;
     void buildBVH();
-    Vector3f castRay(const Ray &ray, int depth) const;
-    void sampleLight(Intersection &pos, float &pdf) const;
+    // alternative to buildBVH: one BVH directly over every triangle and analytic primitive in the scene
+    void compile();
+    // leaf entry of the compiled BVH: sub-primitive index of a scene object, in BVH leaf order
+    struct PrimitiveRef {
+        Object* object;
+        int index;
+    };
+    std::vector<PrimitiveRef> compiledPrimitives;
+    // The compiled BVH keeps every leaf to one of these types and reports it, so leaves are
+    // intersected by a switch over type-homogeneous arrays instead of a virtual call per
+    // primitive. Anything that is not a plain triangle or sphere (e.g. an Instance) stays an
+    // Object and goes through intersectPrimitive.
+    enum PrimitiveType : uint8_t { PRIM_TRIANGLE, PRIM_SPHERE, PRIM_OBJECT };
+    // slot -> position in the array of its type; slots are numbered in leaf order, so a leaf
+    // [first, first + count) is the run starting at compiledIndex[first]
+    std::vector<int> compiledIndex;
+    std::vector<TrianglePacket<kTrianglePacketWidth>> compiledTriangles; // triangle i: packet i / W, lane i % W
+    std::vector<Sphere*> compiledSpheres;
+    // closest hit of ray among the compiled leaf [first, first + count) of the given type,
+    // hit.t is the current tMax and shrinks with every closer hit
+    bool intersectLeaf(const Ray& ray, const WideRay& wideRay, int first, int count, int type, HitRecord& hit) const;
+    // emitting objects with their running area sum, gathered by buildBVH/compile for sampleLight
+    std::vector<Object*> emitters;
+    std::vector<float> emitterAreaCdf;
+    // radiance along ray, unclamped; depth is the number of bounces the path has already taken
+    // sampler supplies every random decision of the path
+    Vector3f castRay(const Ray &ray, int depth, Sampler &sampler) const;
+    // the same for a ray whose closest hit is already known (e.g. from intersectPacket)
+    Vector3f castRay(const Ray &ray, const Intersection &hit, int depth, Sampler &sampler) const;
+    // the steps of one path vertex, shared by castRay and the wavefront renderer:
+    // emission reaching a ray that hit an emitter, bsdfPdf is the pdf of the BSDF sample that
+    // produced the ray (0 for camera rays)
+    Vector3f emittedRadiance(const Ray &ray, const Intersection &hit, float bsdfPdf) const;
+    // light sample for a hit seen from wo: the shadow ray and the radiance it brings if unoccluded,
+    // false when it can not contribute
+    bool sampleDirect(const Intersection &hit, const Vector3f &wo, int depth, Ray &shadowRay, Vector3f &radiance,
+                      Sampler &sampler) const;
+    // continues the path in a BSDF-sampled direction after depth bounces, updating throughput and
+    // bsdfPdf; false when the path ends (absorbed or Russian roulette)
+    bool sampleBounce(const Intersection &hit, const Vector3f &wo, int depth, Vector3f &throughput, float &bsdfPdf,
+                      Ray &next, Sampler &sampler) const;
+    // point on an emitter, chosen proportional to area; pdf is per unit area over all emitters
+    void sampleLight(Intersection &pos, float &pdf, Sampler &sampler) const;
     bool trace(const Ray &ray, const std::vector<Object*> &objects, float &tNear, uint32_t &index, Object **hitObject);
     std::tuple<Vector3f, Vector3f> HandleAreaLight(const AreaLight &light, const Vector3f &hitPoint, const Vector3f &N,
                                                    const Vector3f &shadowPointOrig,
@@ -40,26 +40,45 @@ public:
 
         return true;
     }
-    Intersection getIntersection(Ray ray) {
+    bool intersect(const Ray& ray, HitRecord& hit) {
+        float t;
+        if (!this->hit(ray, hit.t, t)) return false;
+        hit.t = t;
+        hit.primId = 0;
+        return true;
+    }
+    Intersection finalize(const Ray& ray, const HitRecord& hit) {
         Intersection result;
-        result.happened = false;
+        result.happened = true;
+        // ray(t) projected back onto the surface, leaving only the rounding of the projection
+        Vector3f offset = ray(hit.t) - center;
+        offset = offset * (radius / offset.norm());
+        result.coords = center + offset;
+        result.pError = gammaBound(5) * Vector3f::Abs(offset) + gammaBound(1) * Vector3f::Abs(result.coords);
+        result.normal = result.geoNormal = normalize(offset);
+        result.m = this->m;
+        result.obj = this;
+        result.distance = hit.t;
+        return result;
+    }
+    bool occluded(const Ray& ray) {
+        float t;
+        return hit(ray, ray.t_max, t);
+    }
+    // nearest root in (tError, tMax). For an origin on the surface c cancels to ~0 and the root
+    // near 0 is c / q, so the rounding of c over |q| (a times the larger root) bounds how far a
+    // ray leaving the sphere can see its own surface in front of it.
+    bool hit(const Ray& ray, float tMax, float& t) const {
         Vector3f L = ray.origin - center;
         float a = dotProduct(ray.direction, ray.direction);
         float b = 2 * dotProduct(ray.direction, L);
         float c = dotProduct(L, L) - radius2;
         float t0, t1;
-        if (!solveQuadratic(a, b, c, t0, t1)) return result;
-        if (t0 < 0.01) t0 = t1;
-        if (t0 < 0.01) return result;
-        result.happened = true;
-
-        result.coords = Vector3f(ray.origin + ray.direction * t0);
-        result.normal = normalize(Vector3f(result.coords - center));
-        result.m = this->m;
-        result.obj = this;
-        result.distance = t0;
-        return result;
-
+        if (!solveQuadratic(a, b, c, t0, t1)) return false;
+        float cError = gammaBound(3) * (dotProduct(L, L) + radius2) / (a * std::max(std::fabs(t0), std::fabs(t1)));
+        auto tError = [&](float root) { return cError + gammaBound(7) * std::fabs(root); };
+        t = t0 > tError(t0) ? t0 : t1;
+        return t > tError(t) && t < tMax;
     }
     void getSurfaceProperties(const Vector3f& P, const Vector3f& I, const uint32_t& index, const Vector2f& uv, Vector3f& N, Vector2f& st) const {
         N = normalize(P - center);
@@ -73,11 +92,13 @@ public:
         return Bounds3(Vector3f(center.x - radius, center.y - radius, center.z - radius),
             Vector3f(center.x + radius, center.y + radius, center.z + radius));
     }
-    void Sample(Intersection& pos, float& pdf) {
-        float theta = 2.0 * M_PI * get_random_float(), phi = M_PI * get_random_float();
+    void Sample(Intersection& pos, float& pdf, Sampler& sampler) {
+        Vector2f u = sampler.get2D();
+        float theta = 2.0 * M_PI * u.x, phi = M_PI * u.y;
         Vector3f dir(std::cos(phi), std::sin(phi) * std::cos(theta), std::sin(phi) * std::sin(theta));
         pos.coords = center + radius * dir;
-        pos.normal = dir;
+        pos.pError = gammaBound(5) * Vector3f::Abs(radius * dir) + gammaBound(1) * Vector3f::Abs(pos.coords);
+        pos.normal = pos.geoNormal = dir;
         pos.emit = m->getEmission();
         pdf = 1.0f / area;
     }
@@ -0,0 +1,94 @@
+#ifndef RAYTRACING_TILESCHEDULER_H
+#define RAYTRACING_TILESCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// screen-space rectangle [x0, x1) x [y0, y1) rendered as one unit of work
+struct ImageTile {
+    int x0, y0, x1, y1;
+    int pixelCount() const { return (x1 - x0) * (y1 - y0); }
+};
+
+// Per-thread double-ended tile queue. The owner pops from the front (tiles
+// are dealt in scanline order, so it walks its own region coherently), idle
+// threads steal from the back, i.e. as far away from the owner as possible.
+class TileDeque {
+public:
+    void push(const ImageTile& tile) {
+        std::lock_guard<std::mutex> lock(mutex);
+        tiles.push_back(tile);
+    }
+    bool pop(ImageTile& tile) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (tiles.empty()) return false;
+        tile = tiles.front();
+        tiles.pop_front();
+        return true;
+    }
+    bool steal(ImageTile& tile) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (tiles.empty()) return false;
+        tile = tiles.back();
+        tiles.pop_back();
+        return true;
+    }
+
+private:
+    std::mutex mutex;
+    std::deque<ImageTile> tiles;
+};
+
+// Splits the image into tileSize x tileSize tiles, deals contiguous runs of
+// them to every worker and lets workers that run dry steal from the others.
+class TileScheduler {
+public:
+    TileScheduler(int width, int height, int tileSize, int numThreads)
+        : queues(std::max(1, numThreads)), completedTiles(0), completedPixels(0),
+        totalPixels(width * height) {
+        tileSize = std::max(1, tileSize);
+        std::vector<ImageTile> tiles;
+        for (int y = 0; y < height; y += tileSize)
+            for (int x = 0; x < width; x += tileSize)
+                tiles.push_back({ x, y, std::min(x + tileSize, width), std::min(y + tileSize, height) });
+        totalTiles = (int)tiles.size();
+
+        int n = (int)queues.size();
+        for (int i = 0; i < totalTiles; i++)
+            queues[(size_t)i * n / totalTiles].push(tiles[i]);
+    }
+
+    // fetch the next tile for worker threadIndex, stealing if its own queue is empty
+    bool next(int threadIndex, ImageTile& tile) {
+        int n = (int)queues.size();
+        if (queues[threadIndex].pop(tile))
+            return true;
+        for (int k = 1; k < n; k++) {
+            if (queues[(threadIndex + k) % n].steal(tile))
+                return true;
+        }
+        return false;
+    }
+
+    // mark a tile as finished, returns the fraction of the image completed so far
+    float complete(const ImageTile& tile) {
+        completedTiles.fetch_add(1);
+        int done = completedPixels.fetch_add(tile.pixelCount()) + tile.pixelCount();
+        return totalPixels > 0 ? done / (float)totalPixels : 1.0f;
+    }
+
+    int tileCount() const { return totalTiles; }
+    int tilesCompleted() const { return completedTiles.load(); }
+
+private:
+    std::vector<TileDeque> queues;
+    std::atomic<int> completedTiles;
+    std::atomic<int> completedPixels;
+    int totalPixels;
+    int totalTiles;
+};
+
+#endif //RAYTRACING_TILESCHEDULER_H
@@ -0,0 +1,120 @@
+#ifndef RAYTRACING_TRANSFORM_H
+#define RAYTRACING_TRANSFORM_H
+
+#include <cmath>
+#include "Vector.hpp"
+#include "Bounds3.hpp"
+#include "global.hpp"
+
+// affine transform stored as the upper 3x4 rows of a 4x4 matrix, together with its inverse
+class Transform {
+public:
+    Transform() {
+        setIdentity(m);
+        setIdentity(mInv);
+    }
+    Transform(const float mat[3][4], const float matInv[3][4]) {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++) {
+                m[i][j] = mat[i][j];
+                mInv[i][j] = matInv[i][j];
+            }
+    }
+
+    static Transform Translate(const Vector3f& d) {
+        float mat[3][4] = { { 1, 0, 0, d.x }, { 0, 1, 0, d.y }, { 0, 0, 1, d.z } };
+        float inv[3][4] = { { 1, 0, 0, -d.x }, { 0, 1, 0, -d.y }, { 0, 0, 1, -d.z } };
+        return Transform(mat, inv);
+    }
+    static Transform Scale(float x, float y, float z) {
+        float mat[3][4] = { { x, 0, 0, 0 }, { 0, y, 0, 0 }, { 0, 0, z, 0 } };
+        float inv[3][4] = { { 1 / x, 0, 0, 0 }, { 0, 1 / y, 0, 0 }, { 0, 0, 1 / z, 0 } };
+        return Transform(mat, inv);
+    }
+    // rotation by theta degrees around axis (through the origin)
+    static Transform Rotate(float theta, const Vector3f& axis) {
+        Vector3f a = normalize(axis);
+        float sinTheta = std::sin(theta * M_PI / 180), cosTheta = std::cos(theta * M_PI / 180);
+        float mat[3][4] = {
+            { a.x * a.x + (1 - a.x * a.x) * cosTheta, a.x * a.y * (1 - cosTheta) - a.z * sinTheta,
+              a.x * a.z * (1 - cosTheta) + a.y * sinTheta, 0 },
+            { a.x * a.y * (1 - cosTheta) + a.z * sinTheta, a.y * a.y + (1 - a.y * a.y) * cosTheta,
+              a.y * a.z * (1 - cosTheta) - a.x * sinTheta, 0 },
+            { a.x * a.z * (1 - cosTheta) - a.y * sinTheta, a.y * a.z * (1 - cosTheta) + a.x * sinTheta,
+              a.z * a.z + (1 - a.z * a.z) * cosTheta, 0 } };
+        // rotations are orthogonal, the inverse is the transpose
+        float inv[3][4];
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++)
+                inv[i][j] = mat[j][i];
+            inv[i][3] = 0;
+        }
+        return Transform(mat, inv);
+    }
+
+    Transform operator*(const Transform& t2) const {
+        float mat[3][4], inv[3][4];
+        compose(m, t2.m, mat);
+        compose(t2.mInv, mInv, inv);
+        return Transform(mat, inv);
+    }
+    Transform inverse() const { return Transform(mInv, m); }
+
+    Vector3f point(const Vector3f& p) const { return apply(m, p, 1); }
+    Vector3f vector(const Vector3f& v) const { return apply(m, v, 0); }
+    // p carrying the absolute error pError: the transformed point and the bound on its error,
+    // the propagated input error plus the rounding of the transform itself (pbrt 3.9.4)
+    Vector3f point(const Vector3f& p, const Vector3f& pError, Vector3f* pOutError) const {
+        Vector3f absError, absP;
+        for (int i = 0; i < 3; i++) {
+            absError[i] = std::fabs(m[i][0]) * pError.x + std::fabs(m[i][1]) * pError.y + std::fabs(m[i][2]) * pError.z;
+            absP[i] = std::fabs(m[i][0] * p.x) + std::fabs(m[i][1] * p.y) + std::fabs(m[i][2] * p.z) +
+                      std::fabs(m[i][3]);
+        }
+        *pOutError = (gammaBound(3) + 1) * absError + gammaBound(3) * absP;
+        return point(p);
+    }
+    // normals transform with the inverse transpose
+    Vector3f normal(const Vector3f& n) const {
+        return Vector3f(mInv[0][0] * n.x + mInv[1][0] * n.y + mInv[2][0] * n.z,
+                        mInv[0][1] * n.x + mInv[1][1] * n.y + mInv[2][1] * n.z,
+                        mInv[0][2] * n.x + mInv[1][2] * n.y + mInv[2][2] * n.z);
+    }
+    Bounds3 bounds(const Bounds3& b) const {
+        Bounds3 ret;
+        for (int corner = 0; corner < 8; corner++) {
+            Vector3f p((corner & 1 ? b.pMax : b.pMin).x, (corner & 2 ? b.pMax : b.pMin).y,
+                       (corner & 4 ? b.pMax : b.pMin).z);
+            ret = Union(ret, point(p));
+        }
+        return ret;
+    }
+    float determinant() const {
+        return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+               m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+               m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    }
+
+private:
+    float m[3][4], mInv[3][4];
+
+    static void setIdentity(float mat[3][4]) {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++)
+                mat[i][j] = i == j ? 1.f : 0.f;
+    }
+    static void compose(const float a[3][4], const float b[3][4], float r[3][4]) {
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++)
+                r[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j];
+            r[i][3] += a[i][3];
+        }
+    }
+    static Vector3f apply(const float mat[3][4], const Vector3f& p, float w) {
+        return Vector3f(mat[0][0] * p.x + mat[0][1] * p.y + mat[0][2] * p.z + mat[0][3] * w,
+                        mat[1][0] * p.x + mat[1][1] * p.y + mat[1][2] * p.z + mat[1][3] * w,
+                        mat[2][0] * p.x + mat[2][1] * p.y + mat[2][2] * p.z + mat[2][3] * w);
+    }
+};
+
+#endif //RAYTRACING_TRANSFORM_H
@@ -6,10 +6,13 @@
 #include "OBJ_Loader.hpp"
 #include "Object.hpp"
 #include "Triangle.hpp"
+#include "TrianglePacket.hpp"
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <unordered_map>
 
-bool rayTriangleIntersect(const Vector3f &v0, const Vector3f &v1,
+inline bool rayTriangleIntersect(const Vector3f &v0, const Vector3f &v1,
                           const Vector3f &v2, const Vector3f &orig,
                           const Vector3f &dir, float &tnear, float &u,
                           float &v) {
@@ -59,7 +62,15 @@ class Triangle : public Object {
     bool intersect(const Ray &ray) override;
     bool intersect(const Ray &ray, float &tnear,
                    uint32_t &index) const override;
-    Intersection getIntersection(Ray ray) override;
+    bool intersect(const Ray &ray, HitRecord &hit) override;
+    Intersection finalize(const Ray &ray, const HitRecord &hit) override;
+    bool occluded(const Ray &ray) override;
+    bool primitiveTriangle(int, Vector3f &a, Vector3f &b, Vector3f &c) override {
+        a = v0, b = v1, c = v2;
+        return true;
+    }
+    // watertight test shared by intersect and occluded, u/v weight v1/v2
+    inline bool hit(const Ray &ray, float tMax, float &t, float &u, float &v) const;
     void getSurfaceProperties(const Vector3f &P, const Vector3f &I,
                               const uint32_t &index, const Vector2f &uv,
                               Vector3f &N, Vector2f &st) const override {
@@ -69,19 +80,35 @@ class Triangle : public Object {
     }
     Vector3f evalDiffuseColor(const Vector2f &) const override;
     Bounds3 getBounds() override;
-    void Sample(Intersection &pos, float &pdf) {
-        float x = std::sqrt(get_random_float()), y = get_random_float();
-        pos.coords = v0 * (1.0f - x) + v1 * (x * (1.0f - y)) + v2 * (x * y);
-        pos.normal = this->normal;
+    void Sample(Intersection &pos, float &pdf, Sampler &sampler) {
+        Vector2f u = sampler.get2D();
+        float x = std::sqrt(u.x), y = u.y;
+        Vector3f b(1.0f - x, x * (1.0f - y), x * y);
+        pos.coords = v0 * b.x + v1 * b.y + v2 * b.z;
+        pos.pError = gammaBound(6) * (Vector3f::Abs(v0 * b.x) + Vector3f::Abs(v1 * b.y) + Vector3f::Abs(v2 * b.z));
+        pos.normal = pos.geoNormal = this->normal;
         pdf = 1.0f / area;
     }
     float getArea() { return area; }
     bool hasEmit() { return m->hasEmission(); }
 };
 
+// Indexed triangle mesh: corners are deduplicated into one shared vertex
+// buffer and every triangle is three 32-bit indices into it. Normals and
+// texture coordinates are only stored when the file provides them. The mesh's
+// own BVH and SoA triangle packets are only built by buildAccel, a compiled
+// scene copies the triangles into its BVH instead and never needs them. The
+// BVH is built over the triangles' bounds and the packets follow its leaf
+// order, so a leaf is a contiguous run of packet lanes; leafTriangles maps
+// them back to triangles. The index buffer keeps the file order, so triangle
+// ids stay valid for a compiled scene that shares the mesh with an Instance.
 class MeshTriangle : public Object {
   public:
-    MeshTriangle(const std::string &filename, Material *mt = new Material()) {
+    MeshTriangle(const std::string &filename, Material *mt = new Material(),
+                 BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::SAH,
+                 BVHAccel::NodeLayout nodeLayout = BVHAccel::NodeLayout::BINARY,
+                 int maxPrimsInNode = kTrianglePacketWidth)
+        : splitMethod(splitMethod), nodeLayout(nodeLayout), maxPrimsInNode(maxPrimsInNode) {
         objl::Loader loader;
         loader.LoadFile(filename);
         area = 0;
@@ -89,61 +116,91 @@ class MeshTriangle : public Object {
         assert(loader.LoadedMeshes.size() == 1);
         auto mesh = loader.LoadedMeshes[0];
 
-        Vector3f min_vert = Vector3f{std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity()};
-        Vector3f max_vert = Vector3f{-std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity()};
-        for (int i = 0; i < mesh.Vertices.size(); i += 3) {
-            std::array<Vector3f, 3> face_vertices;
-
+        // the loader fills in flat normals when the file has none, a normal stream is
+        // only kept if some vertex normal actually differs from its face normal
+        bool hasNormals = false, hasUVs = false;
+        for (size_t i = 0; i + 2 < mesh.Indices.size(); i += 3) {
+            Vector3f p[3], n[3];
             for (int j = 0; j < 3; j++) {
-                auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-                                     mesh.Vertices[i + j].Position.Y,
-                                     mesh.Vertices[i + j].Position.Z);
-                face_vertices[j] = vert;
-
-                min_vert = Vector3f(std::min(min_vert.x, vert.x),
-                                    std::min(min_vert.y, vert.y),
-                                    std::min(min_vert.z, vert.z));
-                max_vert = Vector3f(std::max(max_vert.x, vert.x),
-                                    std::max(max_vert.y, vert.y),
-                                    std::max(max_vert.z, vert.z));
+                const auto &vert = mesh.Vertices[mesh.Indices[i + j]];
+                p[j] = Vector3f(vert.Position.X, vert.Position.Y, vert.Position.Z);
+                n[j] = normalize(Vector3f(vert.Normal.X, vert.Normal.Y, vert.Normal.Z));
+                hasUVs |= vert.TextureCoordinate.X != 0 || vert.TextureCoordinate.Y != 0;
             }
+            Vector3f faceN = normalize(crossProduct(p[1] - p[0], p[2] - p[0]));
+            for (int j = 0; j < 3; j++)
+                hasNormals |= std::fabs(dotProduct(n[j], faceN)) < 0.9999f;
+        }
 
-            triangles.emplace_back(face_vertices[0], face_vertices[1],
-                                   face_vertices[2], mt);
+        // the loader emits one vertex per face corner, merge corners with identical attributes
+        std::unordered_map<VertexKey, uint32_t, VertexKeyHash> vertexIds;
+        std::vector<uint32_t> loaderToMesh(mesh.Vertices.size());
+        for (size_t i = 0; i < mesh.Vertices.size(); ++i) {
+            const auto &vert = mesh.Vertices[i];
+            VertexKey key = {vert.Position.X, vert.Position.Y, vert.Position.Z,
+                             hasNormals ? vert.Normal.X : 0, hasNormals ? vert.Normal.Y : 0,
+                             hasNormals ? vert.Normal.Z : 0,
+                             hasUVs ? vert.TextureCoordinate.X : 0, hasUVs ? vert.TextureCoordinate.Y : 0};
+            auto inserted = vertexIds.emplace(key, (uint32_t)positions.size());
+            if (inserted.second) {
+                positions.emplace_back(vert.Position.X, vert.Position.Y, vert.Position.Z);
+                if (hasNormals)
+                    normals.emplace_back(vert.Normal.X, vert.Normal.Y, vert.Normal.Z);
+                if (hasUVs)
+                    uvs.emplace_back(vert.TextureCoordinate.X, vert.TextureCoordinate.Y);
+            }
+            loaderToMesh[i] = inserted.first->second;
         }
 
-        bounding_box = Bounds3(min_vert, max_vert);
+        numTriangles = (uint32_t)(mesh.Indices.size() / 3);
+        indices.resize(numTriangles * 3);
+        for (uint32_t k = 0; k < numTriangles; ++k) {
+            for (int j = 0; j < 3; j++)
+                indices[k * 3 + j] = loaderToMesh[mesh.Indices[k * 3 + j]];
+            bounding_box = Union(bounding_box, primitiveBounds(k));
+        }
+        areaCdf.reserve(numTriangles);
+        for (uint32_t k = 0; k < numTriangles; ++k) {
+            area += triangleArea(k);
+            areaCdf.push_back(area);
+        }
+    }
 
-        std::vector<Object *> ptrs;
-        for (auto &tri : triangles) {
-            ptrs.push_back(&tri);
-            area += tri.area;
+    void buildAccel() {
+        if (bvh)
+            return;
+        std::vector<Bounds3> triBounds(numTriangles);
+        for (uint32_t k = 0; k < numTriangles; ++k)
+            triBounds[k] = primitiveBounds(k);
+        bvh = new BVHAccel(triBounds, maxPrimsInNode, splitMethod, nodeLayout);
+        const std::vector<int> &order = bvh->primitiveOrder();
+        leafTriangles.assign(order.begin(), order.end());
+
+        // SoA copies for the leaf kernel, packet p holds the triangles of slots [p * W, p * W + W)
+        constexpr int W = kTrianglePacketWidth;
+        packets.resize((numTriangles + W - 1) / W);
+        for (uint32_t s = 0; s < numTriangles; ++s) {
+            uint32_t k = leafTriangles[s];
+            packets[s / W].setTriangle(s % W, vertex(k, 0), vertex(k, 1), vertex(k, 2));
         }
-        bvh = new BVHAccel(ptrs);
     }
 
+    ~MeshTriangle() { delete bvh; }
+
     bool intersect(const Ray &ray) { return true; }
 
     bool intersect(const Ray &ray, float &tnear, uint32_t &index) const {
         bool intersect = false;
-        for (uint32_t k = 0; k < numTriangles; ++k) {
-            const Vector3f &v0 = vertices[vertexIndex[k * 3]];
-            const Vector3f &v1 = vertices[vertexIndex[k * 3 + 1]];
-            const Vector3f &v2 = vertices[vertexIndex[k * 3 + 2]];
-            float t, u, v;
-            if (rayTriangleIntersect(v0, v1, v2, ray.origin, ray.direction, t,
-                                     u, v) &&
-                t < tnear) {
-                tnear = t;
+        WideRay wideRay(ray);
+        bvh->traverse(ray, tnear, [&](int first, int count, int, float &tMax) {
+            int k;
+            float u, v;
+            if (leafClosestHit(wideRay, first, count, tMax, k, u, v)) {
+                tnear = tMax;
                 index = k;
-                intersect |= true;
+                intersect = true;
             }
-        }
-
+        });
         return intersect;
     }
 
@@ -152,16 +209,8 @@ class MeshTriangle : public Object {
     void getSurfaceProperties(const Vector3f &P, const Vector3f &I,
                               const uint32_t &index, const Vector2f &uv,
                               Vector3f &N, Vector2f &st) const {
-        const Vector3f &v0 = vertices[vertexIndex[index * 3]];
-        const Vector3f &v1 = vertices[vertexIndex[index * 3 + 1]];
-        const Vector3f &v2 = vertices[vertexIndex[index * 3 + 2]];
-        Vector3f e0 = normalize(v1 - v0);
-        Vector3f e1 = normalize(v2 - v1);
-        N = normalize(crossProduct(e0, e1));
-        const Vector2f &st0 = stCoordinates[vertexIndex[index * 3]];
-        const Vector2f &st1 = stCoordinates[vertexIndex[index * 3 + 1]];
-        const Vector2f &st2 = stCoordinates[vertexIndex[index * 3 + 2]];
-        st = st0 * (1 - uv.x - uv.y) + st1 * uv.x + st2 * uv.y;
+        N = shadingNormal(index, uv.x, uv.y);
+        st = uvs.empty() ? uv : texCoords(index, uv.x, uv.y);
     }
 
     Vector3f evalDiffuseColor(const Vector2f &st) const {
@@ -172,35 +221,170 @@ class MeshTriangle : public Object {
                     Vector3f(0.937, 0.937, 0.231), pattern);
     }
 
-    Intersection getIntersection(Ray ray) {
-        Intersection intersec;
+    // closest hit over the mesh BVH, only t, the triangle and its barycentrics are kept
+    bool intersect(const Ray &ray, HitRecord &hit) {
+        bool found = false;
+        WideRay wideRay(ray);
+        bvh->traverse(ray, hit.t, [&](int first, int count, int, float &tMax) {
+            if (leafClosestHit(wideRay, first, count, tMax, hit.primId, hit.u, hit.v)) {
+                hit.t = tMax;
+                found = true;
+            }
+        });
+        return found;
+    }
+    Intersection finalize(const Ray &ray, const HitRecord &hit) {
+        return makeIntersection(hit.primId, ray, hit.t, hit.u, hit.v);
+    }
 
-        if (bvh) {
-            intersec = bvh->Intersect(ray);
-        }
+    bool occluded(const Ray &ray) {
+        WideRay wideRay(ray);
+        float tMax = ray.t_max;
+        return bvh->traverseAny(ray, [&](int first, int count, int) {
+            constexpr int W = kTrianglePacketWidth;
+            for (int p = first / W; p * W < first + count; ++p)
+                if (packets[p].anyHit(wideRay, laneMask(p, first, count), tMax))
+                    return true;
+            return false;
+        });
+    }
 
-        return intersec;
+    // every triangle is its own primitive in a compiled scene, which packs them itself; the
+    // per-triangle tests below are only a fallback and do not need buildAccel
+    int primitiveCount() { return (int)numTriangles; }
+    Bounds3 primitiveBounds(int k) {
+        return Union(Bounds3(vertex(k, 0), vertex(k, 1)), vertex(k, 2));
+    }
+    bool intersectPrimitive(int k, const Ray &ray, HitRecord &hit) {
+        if (trianglePacket(k).closestHit(WideRay(ray), 1, hit.t, hit.u, hit.v) < 0)
+            return false;
+        hit.primId = k;
+        return true;
+    }
+    bool primitiveOccluded(int k, const Ray &ray) {
+        return trianglePacket(k).anyHit(WideRay(ray), 1, ray.t_max);
+    }
+    bool primitiveTriangle(int k, Vector3f &a, Vector3f &b, Vector3f &c) {
+        a = vertex(k, 0), b = vertex(k, 1), c = vertex(k, 2);
+        return true;
     }
 
-    void Sample(Intersection &pos, float &pdf) {
-        bvh->Sample(pos, pdf);
+    void Sample(Intersection &pos, float &pdf, Sampler &sampler) {
+        float p = sampler.get1D() * area;
+        uint32_t k = std::min(uint32_t(std::upper_bound(areaCdf.begin(), areaCdf.end(), p) - areaCdf.begin()),
+                              numTriangles - 1);
+        Vector2f u = sampler.get2D();
+        float x = std::sqrt(u.x), y = u.y;
+        pos.coords = interpolate(k, x * (1.0f - y), x * y, &pos.pError);
+        pos.normal = pos.geoNormal = faceNormal(k);
+        // uniform over the whole surface: the triangle is picked proportional to its area
+        pdf = 1.0f / area;
         pos.emit = m->getEmission();
     }
     float getArea() { return area; }
     bool hasEmit() { return m->hasEmission(); }
 
     Bounds3 bounding_box;
-    std::unique_ptr<Vector3f[]> vertices;
     uint32_t numTriangles;
-    std::unique_ptr<uint32_t[]> vertexIndex;
-    std::unique_ptr<Vector2f[]> stCoordinates;
-
-    std::vector<Triangle> triangles;
-
-    BVHAccel *bvh;
+    std::vector<Vector3f> positions;
+    std::vector<Vector3f> normals; // per vertex, empty when the file has none
+    std::vector<Vector2f> uvs;     // per vertex, empty when the file has none
+    std::vector<uint32_t> indices; // 3 per triangle, in file order
+    // running sum of triangle areas, for sampling a point uniformly on the mesh
+    std::vector<float> areaCdf;
+    std::vector<TrianglePacket<kTrianglePacketWidth>> packets; // built by buildAccel
+    // triangle in every slot of the mesh BVH's leaves, built by buildAccel
+    std::vector<uint32_t> leafTriangles;
+
+    BVHAccel *bvh = nullptr; // built by buildAccel
+    BVHAccel::SplitMethod splitMethod;
+    BVHAccel::NodeLayout nodeLayout;
+    int maxPrimsInNode;
     float area;
 
     Material *m;
+
+  private:
+    struct VertexKey {
+        float attr[8];
+        bool operator==(const VertexKey &o) const {
+            return std::equal(attr, attr + 8, o.attr);
+        }
+    };
+    struct VertexKeyHash {
+        size_t operator()(const VertexKey &key) const {
+            size_t h = 0;
+            for (float a : key.attr)
+                h = h * 31 + std::hash<float>()(a);
+            return h;
+        }
+    };
+
+    // point at barycentrics (u, v) of triangle k, with the bound on its rounding error
+    Vector3f interpolate(uint32_t k, float u, float v, Vector3f *pError) const {
+        Vector3f p0 = vertex(k, 0) * (1 - u - v), p1 = vertex(k, 1) * u, p2 = vertex(k, 2) * v;
+        *pError = gammaBound(7) * (Vector3f::Abs(p0) + Vector3f::Abs(p1) + Vector3f::Abs(p2));
+        return p0 + p1 + p2;
+    }
+    const Vector3f &vertex(uint32_t k, int corner) const {
+        return positions[indices[k * 3 + corner]];
+    }
+    Vector3f faceNormal(uint32_t k) const {
+        return normalize(crossProduct(vertex(k, 1) - vertex(k, 0), vertex(k, 2) - vertex(k, 0)));
+    }
+    // triangle k alone in lane 0 of a packet
+    TrianglePacket<kTrianglePacketWidth> trianglePacket(uint32_t k) const {
+        TrianglePacket<kTrianglePacketWidth> packet;
+        packet.setTriangle(0, vertex(k, 0), vertex(k, 1), vertex(k, 2));
+        return packet;
+    }
+    float triangleArea(uint32_t k) const {
+        return crossProduct(vertex(k, 1) - vertex(k, 0), vertex(k, 2) - vertex(k, 0)).norm() * 0.5f;
+    }
+    Vector3f shadingNormal(uint32_t k, float u, float v) const {
+        if (normals.empty())
+            return faceNormal(k);
+        return normalize(normals[indices[k * 3]] * (1 - u - v) + normals[indices[k * 3 + 1]] * u +
+                         normals[indices[k * 3 + 2]] * v);
+    }
+    Vector2f texCoords(uint32_t k, float u, float v) const {
+        return uvs[indices[k * 3]] * (1 - u - v) + uvs[indices[k * 3 + 1]] * u + uvs[indices[k * 3 + 2]] * v;
+    }
+
+    static int laneMask(int p, int first, int count) {
+        return packetLaneMask<kTrianglePacketWidth>(p, first, count);
+    }
+    // closest hit among the leaf triangles [first, first + count), tMax shrinks to its distance;
+    // only t, the triangle and its barycentrics come back, shading data is built later
+    bool leafClosestHit(const WideRay &ray, int first, int count, float &tMax, int &hitIndex, float &hitU,
+                        float &hitV) const {
+        constexpr int W = kTrianglePacketWidth;
+        bool hit = false;
+        for (int p = first / W; p * W < first + count; ++p) {
+            int lane = packets[p].closestHit(ray, laneMask(p, first, count), tMax, hitU, hitV);
+            if (lane >= 0) {
+                hitIndex = (int)leafTriangles[p * W + lane];
+                hit = true;
+            }
+        }
+        return hit;
+    }
+    Intersection makeIntersection(uint32_t k, const Ray &ray, float t, float u, float v) {
+        Intersection inter;
+        inter.happened = true;
+        inter.coords = interpolate(k, u, v, &inter.pError);
+        inter.normal = shadingNormal(k, u, v);
+        inter.geoNormal = faceNormal(k);
+        if (!uvs.empty()) {
+            Vector2f st = texCoords(k, u, v);
+            inter.tcoords = Vector3f(st.x, st.y, 0);
+        }
+        inter.distance = t;
+        inter.obj = this;
+        inter.m = m;
+        inter.emit = m->getEmission();
+        return inter;
+    }
 };
 
 inline bool Triangle::intersect(const Ray &ray) { return true; }
@@ -211,33 +395,30 @@ inline bool Triangle::intersect(const Ray &ray, float &tnear,
 
 inline Bounds3 Triangle::getBounds() { return Union(Bounds3(v0, v1), v2); }
 
-inline Intersection Triangle::getIntersection(Ray ray) {
-    Intersection inter;
+inline bool Triangle::hit(const Ray &ray, float tMax, float &t, float &u, float &v) const {
+    return watertightHit(WideRay(ray), v0, v1, v2, tMax, t, u, v);
+}
 
-    if (dotProduct(ray.direction, normal) > 0)
-        return inter;
-    double u, v, t_tmp = 0;
-    Vector3f pvec = crossProduct(ray.direction, e2);
-    double det = dotProduct(e1, pvec);
-    if (fabs(det) < EPSILON)
-        return inter;
+inline bool Triangle::intersect(const Ray &ray, HitRecord &rec) {
+    float t, u, v;
+    if (!hit(ray, rec.t, t, u, v))
+        return false;
+    rec.t = t;
+    rec.u = u;
+    rec.v = v;
+    rec.primId = 0;
+    return true;
+}
 
-    double det_inv = 1. / det;
-    Vector3f tvec = ray.origin - v0;
-    u = dotProduct(tvec, pvec) * det_inv;
-    if (u < 0 || u > 1)
-        return inter;
-    Vector3f qvec = crossProduct(tvec, e1);
-    v = dotProduct(ray.direction, qvec) * det_inv;
-    if (v < 0 || u + v > 1)
-        return inter;
-    t_tmp = dotProduct(e2, qvec) * det_inv;
-    if(t_tmp < 0.0f) return inter;
-    // TODO find ray triangle intersection
+inline Intersection Triangle::finalize(const Ray &ray, const HitRecord &rec) {
+    Intersection inter;
     inter.happened = true;
-    inter.coords = ray(t_tmp);
-    inter.normal = this->normal;
-    inter.distance = t_tmp;
+    // from the barycentrics rather than ray(t), whose error grows with the distance travelled
+    float b0 = 1 - rec.u - rec.v;
+    inter.coords = v0 * b0 + v1 * rec.u + v2 * rec.v;
+    inter.pError = gammaBound(7) * (Vector3f::Abs(v0 * b0) + Vector3f::Abs(v1 * rec.u) + Vector3f::Abs(v2 * rec.v));
+    inter.normal = inter.geoNormal = this->normal;
+    inter.distance = rec.t;
     inter.obj = this;
     inter.m = m;
     inter.emit = m->getEmission();
@@ -245,6 +426,11 @@ inline Intersection Triangle::getIntersection(Ray ray) {
     return inter;
 }
 
+inline bool Triangle::occluded(const Ray &ray) {
+    float t, u, v;
+    return hit(ray, ray.t_max, t, u, v);
+}
+
 inline Vector3f Triangle::evalDiffuseColor(const Vector2f &) const {
     return Vector3f(0.5, 0.5, 0.5);
 }
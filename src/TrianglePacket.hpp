@@ -0,0 +1,257 @@
+#ifndef RAYTRACING_TRIANGLEPACKET_H
+#define RAYTRACING_TRIANGLEPACKET_H
+
+#include "Vector.hpp"
+#include "WideBVH.hpp"
+#include "global.hpp"
+#include <algorithm>
+#include <cmath>
+
+// Watertight ray-triangle test (Woop et al. 2013, as in pbrt 3.6.2), front faces only. The
+// triangle is moved into a space where the ray starts at the origin and runs along +z, so hits
+// reduce to 2D edge functions whose signs are exact: a ray through a shared edge or vertex hits
+// at least one of the triangles around it. Hits are only reported for t in (deltaT, tMax),
+// deltaT being the rounding error bound of t, which replaces any epsilon on t or the determinant.
+inline bool watertightHit(const WideRay& ray, const Vector3f& v0, const Vector3f& v1, const Vector3f& v2,
+                          float tMax, float& t, float& b1, float& b2) {
+    const Vector3f* v[3] = { &v0, &v1, &v2 };
+    float px[3], py[3], pz[3];
+    for (int c = 0; c < 3; c++) {
+        float x = (*v[c])[ray.kx] - ray.org[ray.kx];
+        float y = (*v[c])[ray.ky] - ray.org[ray.ky];
+        float z = (*v[c])[ray.kz] - ray.org[ray.kz];
+        px[c] = x + ray.sx * z;
+        py[c] = y + ray.sy * z;
+        pz[c] = z * ray.sz;
+    }
+    // twice the signed areas of the sub-triangles opposite each vertex, e == 0 is an edge hit
+    float e0 = px[1] * py[2] - py[1] * px[2];
+    float e1 = px[2] * py[0] - py[2] * px[0];
+    float e2 = px[0] * py[1] - py[0] * px[1];
+    float det = e0 + e1 + e2;
+    // negative edge functions are outside, a negative determinant is a back face
+    if (e0 < 0 || e1 < 0 || e2 < 0 || det <= 0)
+        return false;
+    float tScaled = e0 * pz[0] + e1 * pz[1] + e2 * pz[2];
+    if (tScaled <= 0 || tScaled >= tMax * det)
+        return false;
+    float invDet = 1 / det;
+    t = tScaled * invDet;
+
+    float maxXt = std::max({ std::fabs(px[0]), std::fabs(px[1]), std::fabs(px[2]) });
+    float maxYt = std::max({ std::fabs(py[0]), std::fabs(py[1]), std::fabs(py[2]) });
+    float maxZt = std::max({ std::fabs(pz[0]), std::fabs(pz[1]), std::fabs(pz[2]) });
+    float deltaX = gammaBound(5) * (maxXt + maxZt);
+    float deltaY = gammaBound(5) * (maxYt + maxZt);
+    float deltaZ = gammaBound(3) * maxZt;
+    float deltaE = 2 * (gammaBound(2) * maxXt * maxYt + deltaY * maxXt + deltaX * maxYt);
+    float maxE = std::max({ e0, e1, e2 });
+    float deltaT = 3 * (gammaBound(3) * maxE * maxZt + deltaE * maxZt + deltaZ * maxE) * invDet;
+    if (t <= deltaT)
+        return false;
+    b1 = e1 * invDet;
+    b2 = e2 * invDet;
+    return true;
+}
+
+// N triangles of a mesh stored SoA ([corner][axis][lane]) so one watertight test covers all
+// of them. Lanes that were never set are degenerate (det 0) and can not be hit.
+template <int N>
+struct alignas(32) TrianglePacket {
+    float p[3][3][N];
+
+    TrianglePacket() {
+        for (int c = 0; c < 3; c++)
+            for (int a = 0; a < 3; a++)
+                for (int i = 0; i < N; i++)
+                    p[c][a][i] = 0;
+    }
+
+    void setTriangle(int i, const Vector3f& a, const Vector3f& b, const Vector3f& c) {
+        for (int k = 0; k < 3; k++) {
+            p[0][k][i] = a[k];
+            p[1][k][i] = b[k];
+            p[2][k][i] = c[k];
+        }
+    }
+
+    // watertightHit for every lane in laneMask: returns the mask of lanes hit with t in
+    // (deltaT, tMax) and writes their distance and barycentrics of corners 1 and 2 to t/u/v
+    inline int intersect(const WideRay& ray, int laneMask, float tMax, float* t, float* u, float* v) const;
+
+    // closest hit among laneMask, returns its lane (-1 if none) and shrinks tMax to its distance
+    int closestHit(const WideRay& ray, int laneMask, float& tMax, float& hitU, float& hitV) const {
+        alignas(32) float t[N], u[N], v[N];
+        int mask = intersect(ray, laneMask, tMax, t, u, v);
+        int lane = -1;
+        for (int i = 0; mask; i++, mask >>= 1) {
+            if ((mask & 1) && t[i] < tMax) {
+                tMax = t[i];
+                lane = i;
+            }
+        }
+        if (lane >= 0) {
+            hitU = u[lane];
+            hitV = v[lane];
+        }
+        return lane;
+    }
+
+    // any hit among laneMask with t in (0, tMax)
+    bool anyHit(const WideRay& ray, int laneMask, float tMax) const {
+        alignas(32) float t[N], u[N], v[N];
+        return intersect(ray, laneMask, tMax, t, u, v) != 0;
+    }
+};
+
+template <int N>
+inline int TrianglePacket<N>::intersect(const WideRay& ray, int laneMask, float tMax, float* t, float* u,
+                                        float* v) const {
+    int mask = 0;
+    for (int i = 0; i < N; i++) {
+        if (!(laneMask & (1 << i)))
+            continue;
+        Vector3f c[3];
+        for (int k = 0; k < 3; k++)
+            c[k] = Vector3f(p[k][0][i], p[k][1][i], p[k][2][i]);
+        if (watertightHit(ray, c[0], c[1], c[2], tMax, t[i], u[i], v[i]))
+            mask |= 1 << i;
+    }
+    return mask;
+}
+
+// The SIMD kernels are watertightHit with one triangle per lane; the per-ray permutation
+// only changes which axis arrays are loaded.
+#ifdef RAYTRACING_WIDEBVH_SSE
+template <>
+inline int TrianglePacket<4>::intersect(const WideRay& ray, int laneMask, float tMax, float* t, float* u,
+                                        float* v) const {
+    const __m128 signMask = _mm_set1_ps(-0.f);
+    __m128 px[3], py[3], pz[3];
+    for (int c = 0; c < 3; c++) {
+        __m128 x = _mm_sub_ps(_mm_load_ps(p[c][ray.kx]), _mm_set1_ps(ray.org[ray.kx]));
+        __m128 y = _mm_sub_ps(_mm_load_ps(p[c][ray.ky]), _mm_set1_ps(ray.org[ray.ky]));
+        __m128 z = _mm_sub_ps(_mm_load_ps(p[c][ray.kz]), _mm_set1_ps(ray.org[ray.kz]));
+        px[c] = _mm_add_ps(x, _mm_mul_ps(_mm_set1_ps(ray.sx), z));
+        py[c] = _mm_add_ps(y, _mm_mul_ps(_mm_set1_ps(ray.sy), z));
+        pz[c] = _mm_mul_ps(z, _mm_set1_ps(ray.sz));
+    }
+    auto edge = [](__m128 ax, __m128 ay, __m128 bx, __m128 by) {
+        return _mm_sub_ps(_mm_mul_ps(ax, by), _mm_mul_ps(ay, bx));
+    };
+    __m128 e0 = edge(px[1], py[1], px[2], py[2]);
+    __m128 e1 = edge(px[2], py[2], px[0], py[0]);
+    __m128 e2 = edge(px[0], py[0], px[1], py[1]);
+    __m128 det = _mm_add_ps(_mm_add_ps(e0, e1), e2);
+    __m128 zero = _mm_setzero_ps();
+    __m128 valid = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)),
+                              _mm_and_ps(_mm_cmpge_ps(e2, zero), _mm_cmpgt_ps(det, zero)));
+    __m128 tScaled = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0, pz[0]), _mm_mul_ps(e1, pz[1])), _mm_mul_ps(e2, pz[2]));
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(tScaled, zero),
+                                         _mm_cmplt_ps(tScaled, _mm_mul_ps(_mm_set1_ps(tMax), det))));
+    if (!(_mm_movemask_ps(valid) & laneMask))
+        return 0;
+    // degenerate and unset lanes divide by zero here, they already failed the det test
+    __m128 invDet = _mm_div_ps(_mm_set1_ps(1), det);
+    __m128 tt = _mm_mul_ps(tScaled, invDet);
+
+    auto absMax = [&](const __m128* a) {
+        return _mm_max_ps(_mm_max_ps(_mm_andnot_ps(signMask, a[0]), _mm_andnot_ps(signMask, a[1])),
+                          _mm_andnot_ps(signMask, a[2]));
+    };
+    __m128 maxXt = absMax(px), maxYt = absMax(py), maxZt = absMax(pz);
+    __m128 deltaX = _mm_mul_ps(_mm_set1_ps(gammaBound(5)), _mm_add_ps(maxXt, maxZt));
+    __m128 deltaY = _mm_mul_ps(_mm_set1_ps(gammaBound(5)), _mm_add_ps(maxYt, maxZt));
+    __m128 deltaZ = _mm_mul_ps(_mm_set1_ps(gammaBound(3)), maxZt);
+    __m128 deltaE = _mm_mul_ps(_mm_set1_ps(2), _mm_add_ps(_mm_mul_ps(_mm_set1_ps(gammaBound(2)), _mm_mul_ps(maxXt, maxYt)),
+                                                          _mm_add_ps(_mm_mul_ps(deltaY, maxXt), _mm_mul_ps(deltaX, maxYt))));
+    __m128 maxE = _mm_max_ps(_mm_max_ps(e0, e1), e2);
+    __m128 deltaT = _mm_mul_ps(
+        _mm_mul_ps(_mm_set1_ps(3),
+                   _mm_add_ps(_mm_mul_ps(_mm_set1_ps(gammaBound(3)), _mm_mul_ps(maxE, maxZt)),
+                              _mm_add_ps(_mm_mul_ps(deltaE, maxZt), _mm_mul_ps(deltaZ, maxE)))),
+        invDet);
+    valid = _mm_and_ps(valid, _mm_cmpgt_ps(tt, deltaT));
+    _mm_store_ps(t, tt);
+    _mm_store_ps(u, _mm_mul_ps(e1, invDet));
+    _mm_store_ps(v, _mm_mul_ps(e2, invDet));
+    return _mm_movemask_ps(valid) & laneMask;
+}
+#endif
+
+#ifdef __AVX__
+template <>
+inline int TrianglePacket<8>::intersect(const WideRay& ray, int laneMask, float tMax, float* t, float* u,
+                                        float* v) const {
+    const __m256 signMask = _mm256_set1_ps(-0.f);
+    __m256 px[3], py[3], pz[3];
+    for (int c = 0; c < 3; c++) {
+        __m256 x = _mm256_sub_ps(_mm256_load_ps(p[c][ray.kx]), _mm256_set1_ps(ray.org[ray.kx]));
+        __m256 y = _mm256_sub_ps(_mm256_load_ps(p[c][ray.ky]), _mm256_set1_ps(ray.org[ray.ky]));
+        __m256 z = _mm256_sub_ps(_mm256_load_ps(p[c][ray.kz]), _mm256_set1_ps(ray.org[ray.kz]));
+        px[c] = _mm256_add_ps(x, _mm256_mul_ps(_mm256_set1_ps(ray.sx), z));
+        py[c] = _mm256_add_ps(y, _mm256_mul_ps(_mm256_set1_ps(ray.sy), z));
+        pz[c] = _mm256_mul_ps(z, _mm256_set1_ps(ray.sz));
+    }
+    auto edge = [](__m256 ax, __m256 ay, __m256 bx, __m256 by) {
+        return _mm256_sub_ps(_mm256_mul_ps(ax, by), _mm256_mul_ps(ay, bx));
+    };
+    __m256 e0 = edge(px[1], py[1], px[2], py[2]);
+    __m256 e1 = edge(px[2], py[2], px[0], py[0]);
+    __m256 e2 = edge(px[0], py[0], px[1], py[1]);
+    __m256 det = _mm256_add_ps(_mm256_add_ps(e0, e1), e2);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 valid = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(e0, zero, _CMP_GE_OQ), _mm256_cmp_ps(e1, zero, _CMP_GE_OQ)),
+                                 _mm256_and_ps(_mm256_cmp_ps(e2, zero, _CMP_GE_OQ), _mm256_cmp_ps(det, zero, _CMP_GT_OQ)));
+    __m256 tScaled = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e0, pz[0]), _mm256_mul_ps(e1, pz[1])),
+                                   _mm256_mul_ps(e2, pz[2]));
+    valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(tScaled, zero, _CMP_GT_OQ),
+                                               _mm256_cmp_ps(tScaled, _mm256_mul_ps(_mm256_set1_ps(tMax), det),
+                                                             _CMP_LT_OQ)));
+    if (!(_mm256_movemask_ps(valid) & laneMask))
+        return 0;
+    __m256 invDet = _mm256_div_ps(_mm256_set1_ps(1), det);
+    __m256 tt = _mm256_mul_ps(tScaled, invDet);
+
+    auto absMax = [&](const __m256* a) {
+        return _mm256_max_ps(_mm256_max_ps(_mm256_andnot_ps(signMask, a[0]), _mm256_andnot_ps(signMask, a[1])),
+                             _mm256_andnot_ps(signMask, a[2]));
+    };
+    __m256 maxXt = absMax(px), maxYt = absMax(py), maxZt = absMax(pz);
+    __m256 deltaX = _mm256_mul_ps(_mm256_set1_ps(gammaBound(5)), _mm256_add_ps(maxXt, maxZt));
+    __m256 deltaY = _mm256_mul_ps(_mm256_set1_ps(gammaBound(5)), _mm256_add_ps(maxYt, maxZt));
+    __m256 deltaZ = _mm256_mul_ps(_mm256_set1_ps(gammaBound(3)), maxZt);
+    __m256 deltaE = _mm256_mul_ps(
+        _mm256_set1_ps(2), _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(gammaBound(2)), _mm256_mul_ps(maxXt, maxYt)),
+                                         _mm256_add_ps(_mm256_mul_ps(deltaY, maxXt), _mm256_mul_ps(deltaX, maxYt))));
+    __m256 maxE = _mm256_max_ps(_mm256_max_ps(e0, e1), e2);
+    __m256 deltaT = _mm256_mul_ps(
+        _mm256_mul_ps(_mm256_set1_ps(3),
+                      _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(gammaBound(3)), _mm256_mul_ps(maxE, maxZt)),
+                                    _mm256_add_ps(_mm256_mul_ps(deltaE, maxZt), _mm256_mul_ps(deltaZ, maxE)))),
+        invDet);
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(tt, deltaT, _CMP_GT_OQ));
+    _mm256_store_ps(t, tt);
+    _mm256_store_ps(u, _mm256_mul_ps(e1, invDet));
+    _mm256_store_ps(v, _mm256_mul_ps(e2, invDet));
+    return _mm256_movemask_ps(valid) & laneMask;
+}
+#endif
+
+// lanes of packet p that hold triangles [first, first + count), with packet p holding
+// triangles [p * W, p * W + W)
+template <int W>
+inline int packetLaneMask(int p, int first, int count) {
+    int lo = std::max(first - p * W, 0);
+    int hi = std::min(first + count - p * W, W);
+    return ((1 << hi) - 1) & ~((1 << lo) - 1);
+}
+
+// meshes pack their triangles 8 wide when AVX is available, 4 wide otherwise
+#ifdef __AVX__
+constexpr int kTrianglePacketWidth = 8;
+#else
+constexpr int kTrianglePacketWidth = 4;
+#endif
+
+#endif //RAYTRACING_TRIANGLEPACKET_H
@@ -6,6 +6,62 @@
 #include <cmath>
 #include <algorithm>
 
+#ifdef RAYTRACING_SIMD_VECTOR
+#include <immintrin.h>
+
+// SSE layout: x, y, z plus a padding lane w that every operation keeps at zero,
+// so arithmetic, min/max, dot and cross each compile to a few vector instructions.
+// All four lanes are members of one access section, so they are laid out in order
+// and the 16-byte loads and stores cover exactly the object.
+class alignas(16) Vector3f {
+public:
+    float x, y, z, w;
+    Vector3f() : x(0), y(0), z(0), w(0) {}
+    Vector3f(float xx) : x(xx), y(xx), z(xx), w(0) {}
+    Vector3f(float xx, float yy, float zz) : x(xx), y(yy), z(zz), w(0) {}
+    explicit Vector3f(__m128 v) { _mm_store_ps(lanes(), v); }
+    __m128 simd() const { return _mm_load_ps(lanes()); }
+
+    Vector3f operator * (const float &r) const { return Vector3f(_mm_mul_ps(simd(), _mm_set1_ps(r))); }
+    Vector3f operator / (const float &r) const { return Vector3f(_mm_div_ps(simd(), _mm_set1_ps(r))).xyz(); }
+
+    float norm() const;
+    Vector3f normalized() const;
+
+    Vector3f operator * (const Vector3f &v) const { return Vector3f(_mm_mul_ps(simd(), v.simd())); }
+    Vector3f operator - (const Vector3f &v) const { return Vector3f(_mm_sub_ps(simd(), v.simd())); }
+    Vector3f operator + (const Vector3f &v) const { return Vector3f(_mm_add_ps(simd(), v.simd())); }
+    // 0 / 0 in the padding lane, cleared again
+    Vector3f operator / (const Vector3f& v) const { return Vector3f(_mm_div_ps(simd(), v.simd())).xyz(); }
+    Vector3f operator - () const { return Vector3f(_mm_sub_ps(_mm_setzero_ps(), simd())); }
+    Vector3f& operator += (const Vector3f &v) { _mm_store_ps(lanes(), _mm_add_ps(simd(), v.simd())); return *this; }
+    friend Vector3f operator * (const float &r, const Vector3f &v) { return v * r; }
+    friend std::ostream & operator << (std::ostream &os, const Vector3f &v)
+    { return os << v.x << ", " << v.y << ", " << v.z; }
+    float        operator[](int index) const;
+    float&       operator[](int index);
+
+
+    static Vector3f Min(const Vector3f &p1, const Vector3f &p2) {
+        return Vector3f(_mm_min_ps(p1.simd(), p2.simd()));
+    }
+
+    static Vector3f Max(const Vector3f &p1, const Vector3f &p2) {
+        return Vector3f(_mm_max_ps(p1.simd(), p2.simd()));
+    }
+
+    static Vector3f Abs(const Vector3f &p) {
+        return Vector3f(_mm_andnot_ps(_mm_set1_ps(-0.f), p.simd()));
+    }
+
+private:
+    // the whole object as float[4]: it is standard layout and x is its first member
+    float* lanes() { return reinterpret_cast<float*>(this); }
+    const float* lanes() const { return reinterpret_cast<const float*>(this); }
+    Vector3f xyz() const { Vector3f r = *this; r.w = 0; return r; }
+};
+static_assert(sizeof(Vector3f) == 4 * sizeof(float), "Vector3f must be exactly one SSE register");
+#else
 class Vector3f {
 public:
     float x, y, z;
@@ -15,8 +71,8 @@ public:
     Vector3f operator * (const float &r) const { return Vector3f(x * r, y * r, z * r); }
     Vector3f operator / (const float &r) const { return Vector3f(x / r, y / r, z / r); }
 
-    float norm() {return std::sqrt(x * x + y * y + z * z);}
-    Vector3f normalized() {
+    float norm() const {return std::sqrt(x * x + y * y + z * z);}
+    Vector3f normalized() const {
         float n = std::sqrt(x * x + y * y + z * z);
         return Vector3f(x / n, y / n, z / n);
     }
@@ -31,8 +87,8 @@ public:
     { return Vector3f(v.x * r, v.y * r, v.z * r); }
     friend std::ostream & operator << (std::ostream &os, const Vector3f &v)
     { return os << v.x << ", " << v.y << ", " << v.z; }
-    double       operator[](int index) const;
-    double&      operator[](int index);
+    float        operator[](int index) const;
+    float&       operator[](int index);
 
 
     static Vector3f Min(const Vector3f &p1, const Vector3f &p2) {
@@ -44,8 +100,17 @@ public:
         return Vector3f(std::max(p1.x, p2.x), std::max(p1.y, p2.y),
                        std::max(p1.z, p2.z));
     }
+
+    static Vector3f Abs(const Vector3f &p) {
+        return Vector3f(std::fabs(p.x), std::fabs(p.y), std::fabs(p.z));
+    }
 };
-inline double Vector3f::operator[](int index) const {
+#endif
+
+inline float Vector3f::operator[](int index) const {
+    return (&x)[index];
+}
+inline float& Vector3f::operator[](int index) {
     return (&x)[index];
 }
 
@@ -67,6 +132,35 @@ public:
 inline Vector3f lerp(const Vector3f &a, const Vector3f& b, const float &t)
 { return a * (1 - t) + b * t; }
 
+#ifdef RAYTRACING_SIMD_VECTOR
+inline float dotProduct(const Vector3f &a, const Vector3f &b)
+{
+    __m128 m = _mm_mul_ps(a.simd(), b.simd());
+    // (x + y) + (z + 0), the padding lanes are zero
+    __m128 s = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_movehl_ps(s, s)));
+}
+
+inline Vector3f crossProduct(const Vector3f &a, const Vector3f &b)
+{
+    __m128 va = a.simd(), vb = b.simd();
+    __m128 aYzx = _mm_shuffle_ps(va, va, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 bYzx = _mm_shuffle_ps(vb, vb, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(va, bYzx), _mm_mul_ps(aYzx, vb));
+    return Vector3f(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+}
+
+inline Vector3f normalize(const Vector3f &v)
+{
+    float mag2 = dotProduct(v, v);
+    if (mag2 > 0)
+        return v * (1 / sqrtf(mag2));
+    return v;
+}
+
+inline float Vector3f::norm() const { return std::sqrt(dotProduct(*this, *this)); }
+inline Vector3f Vector3f::normalized() const { return *this / norm(); }
+#else
 inline Vector3f normalize(const Vector3f &v)
 {
     float mag2 = v.x * v.x + v.y * v.y + v.z * v.z;
@@ -89,6 +183,7 @@ inline Vector3f crossProduct(const Vector3f &a, const Vector3f &b)
             a.x * b.y - a.y * b.x
     );
 }
+#endif
 
 
 
@@ -0,0 +1,156 @@
+#ifndef RAYTRACING_WIDEBVH_H
+#define RAYTRACING_WIDEBVH_H
+
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include "Bounds3.hpp"
+#include "Ray.hpp"
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <immintrin.h>
+#define RAYTRACING_WIDEBVH_SSE
+#endif
+
+// ray data broadcast against all children of a wide node
+struct WideRay {
+    float org[3];
+    float dir[3];
+    float invDir[3];
+    int dirIsNeg[3];
+    // watertight triangle test: axes permuted so kz is the dominant direction, and
+    // the shear that maps the direction onto +z
+    int kx, ky, kz;
+    float sx, sy, sz;
+
+    WideRay() = default;
+    explicit WideRay(const Ray& ray) {
+        for (int a = 0; a < 3; a++) {
+            org[a] = ray.origin[a];
+            dir[a] = ray.direction[a];
+            invDir[a] = ray.direction_inv[a];
+            dirIsNeg[a] = invDir[a] < 0;
+        }
+        float ax = std::fabs(dir[0]), ay = std::fabs(dir[1]), az = std::fabs(dir[2]);
+        kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+        kx = kz == 2 ? 0 : kz + 1;
+        ky = kx == 2 ? 0 : kx + 1;
+        // swapping for positive directions makes front faces the ones with a positive determinant
+        if (dir[kz] > 0)
+            std::swap(kx, ky);
+        sx = -dir[kx] / dir[kz];
+        sy = -dir[ky] / dir[kz];
+        sz = 1.f / dir[kz];
+    }
+};
+
+// N-ary BVH node collapsed from the binary tree, child bounds stored SoA so
+// one slab test covers every child: bounds[min/max][axis][child]
+template <int N>
+struct alignas(32) WideBVHNode {
+    float bounds[2][3][N];
+    int32_t child[N]; // leaf: first primitive, interior: index of the wide node
+    int16_t count[N]; // leaf: primitive count, 0: interior node, -1: empty slot
+    uint8_t type[N];  // leaf: primitive type key
+    uint8_t pad[N];
+
+    WideBVHNode() {
+        // empty slots get inverted bounds so they never pass the slab test
+        for (int i = 0; i < N; i++)
+            setChild(i, Bounds3(), 0, -1);
+    }
+
+    void setChild(int i, const Bounds3& b, int32_t childIndex, int32_t primCount, uint8_t primType = 0) {
+        for (int a = 0; a < 3; a++) {
+            bounds[0][a][i] = b.pMin[a];
+            bounds[1][a][i] = b.pMax[a];
+        }
+        child[i] = childIndex;
+        count[i] = (int16_t)primCount;
+        type[i] = primType;
+        pad[i] = 0;
+    }
+
+    // test the ray against all N child boxes, returns the hit mask (bit i = child i)
+    // and the entry distance of every child in tNear
+    inline int intersect(const WideRay& ray, float tMax, float* tNear) const;
+};
+
+template <int N>
+inline int WideBVHNode<N>::intersect(const WideRay& ray, float tMax, float* tNear) const {
+    int mask = 0;
+    for (int i = 0; i < N; i++) {
+        float t0 = 0, t1 = tMax;
+        for (int a = 0; a < 3; a++) {
+            float tn = (bounds[ray.dirIsNeg[a]][a][i] - ray.org[a]) * ray.invDir[a];
+            float tf = (bounds[1 - ray.dirIsNeg[a]][a][i] - ray.org[a]) * ray.invDir[a];
+            // NaNs (0 * inf on axis-parallel rays) keep the previous, conservative interval
+            t0 = tn > t0 ? tn : t0;
+            t1 = tf < t1 ? tf : t1;
+        }
+        tNear[i] = t0;
+        if (t0 <= t1 * kRobustSlabScale) mask |= 1 << i;
+    }
+    return mask;
+}
+
+#ifdef RAYTRACING_WIDEBVH_SSE
+template <>
+inline int WideBVHNode<4>::intersect(const WideRay& ray, float tMax, float* tNear) const {
+    __m128 t0 = _mm_setzero_ps();
+    __m128 t1 = _mm_set1_ps(tMax);
+    for (int a = 0; a < 3; a++) {
+        __m128 o = _mm_set1_ps(ray.org[a]);
+        __m128 inv = _mm_set1_ps(ray.invDir[a]);
+        __m128 tn = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[ray.dirIsNeg[a]][a]), o), inv);
+        __m128 tf = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[1 - ray.dirIsNeg[a]][a]), o), inv);
+        // max/min return the second operand when the first is NaN
+        t0 = _mm_max_ps(tn, t0);
+        t1 = _mm_min_ps(tf, t1);
+    }
+    _mm_storeu_ps(tNear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, _mm_mul_ps(t1, _mm_set1_ps(kRobustSlabScale))));
+}
+#endif
+
+#ifdef __AVX__
+template <>
+inline int WideBVHNode<8>::intersect(const WideRay& ray, float tMax, float* tNear) const {
+    __m256 t0 = _mm256_setzero_ps();
+    __m256 t1 = _mm256_set1_ps(tMax);
+    for (int a = 0; a < 3; a++) {
+        __m256 o = _mm256_set1_ps(ray.org[a]);
+        __m256 inv = _mm256_set1_ps(ray.invDir[a]);
+        __m256 tn = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds[ray.dirIsNeg[a]][a]), o), inv);
+        __m256 tf = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds[1 - ray.dirIsNeg[a]][a]), o), inv);
+        t0 = _mm256_max_ps(tn, t0);
+        t1 = _mm256_min_ps(tf, t1);
+    }
+    _mm256_storeu_ps(tNear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, _mm256_mul_ps(t1, _mm256_set1_ps(kRobustSlabScale)), _CMP_LE_OQ));
+}
+#elif defined(RAYTRACING_WIDEBVH_SSE)
+// without AVX an 8-wide node is tested as two 4-wide halves
+template <>
+inline int WideBVHNode<8>::intersect(const WideRay& ray, float tMax, float* tNear) const {
+    int mask = 0;
+    for (int h = 0; h < 8; h += 4) {
+        __m128 t0 = _mm_setzero_ps();
+        __m128 t1 = _mm_set1_ps(tMax);
+        for (int a = 0; a < 3; a++) {
+            __m128 o = _mm_set1_ps(ray.org[a]);
+            __m128 inv = _mm_set1_ps(ray.invDir[a]);
+            __m128 tn = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&bounds[ray.dirIsNeg[a]][a][h]), o), inv);
+            __m128 tf = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&bounds[1 - ray.dirIsNeg[a]][a][h]), o), inv);
+            t0 = _mm_max_ps(tn, t0);
+            t1 = _mm_min_ps(tf, t1);
+        }
+        _mm_storeu_ps(tNear + h, t0);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(t0, _mm_mul_ps(t1, _mm_set1_ps(kRobustSlabScale)))) << h;
+    }
+    return mask;
+}
+#endif
+
+#endif //RAYTRACING_WIDEBVH_H
@@ -1,14 +1,55 @@
 #pragma once
 #include <iostream>
 #include <cmath>
-#include <random>
-#include "RandomGen.hpp"
+#include <cstring>
+#include <limits>
+#include "Sampler.hpp"
+#include "Vector.hpp"
 #undef M_PI
 #define M_PI 3.141592653589793f
 
 extern const float  EPSILON;
 const float kInfinity = std::numeric_limits<float>::max();
 
+// Floating-point error bounds (pbrt, 3.9): every float operation is exact up to a factor
+// (1 +- MachineEpsilon), a chain of n of them is bounded by gammaBound(n).
+constexpr float MachineEpsilon = std::numeric_limits<float>::epsilon() * 0.5f;
+constexpr float gammaBound(int n) { return (n * MachineEpsilon) / (1 - n * MachineEpsilon); }
+
+inline uint32_t floatToBits(float f) { uint32_t u; std::memcpy(&u, &f, sizeof(float)); return u; }
+inline float bitsToFloat(uint32_t u) { float f; std::memcpy(&f, &u, sizeof(float)); return f; }
+
+// next representable float towards +inf / -inf
+inline float nextFloatUp(float v) {
+    if (std::isinf(v) && v > 0) return v;
+    if (v == -0.f) v = 0.f;
+    uint32_t ui = floatToBits(v);
+    if (v >= 0) ++ui; else --ui;
+    return bitsToFloat(ui);
+}
+inline float nextFloatDown(float v) {
+    if (std::isinf(v) && v < 0) return v;
+    if (v == 0.f) v = -0.f;
+    uint32_t ui = floatToBits(v);
+    if (v > 0) --ui; else ++ui;
+    return bitsToFloat(ui);
+}
+
+// Origin for a ray leaving the surface point p (absolute rounding error pError, geometric
+// normal n) in direction w: p pushed along n just past its error box, to the side w points
+// to, then rounded away from p. A ray started there can not re-hit the surface it left.
+inline Vector3f offsetRayOrigin(const Vector3f& p, const Vector3f& pError, const Vector3f& n, const Vector3f& w) {
+    float d = dotProduct(Vector3f::Abs(n), pError);
+    Vector3f offset = d * n;
+    if (dotProduct(w, n) < 0) offset = -offset;
+    Vector3f po = p + offset;
+    for (int i = 0; i < 3; ++i) {
+        if (offset[i] > 0) po[i] = nextFloatUp(po[i]);
+        else if (offset[i] < 0) po[i] = nextFloatDown(po[i]);
+    }
+    return po;
+}
+
 inline float clamp(const float &lo, const float &hi, const float &v)
 { return std::max(lo, std::min(hi, v)); }
 
@@ -16,11 +57,11 @@ inline bool solveQuadratic(const float &a, const float &b, const float &c, float
 {
     float discr = b * b - 4 * a * c;
     if (discr < 0) return false;
-    else if (discr == 0) x0 = x1 = - 0.5 * b / a;
+    else if (discr == 0) x0 = x1 = - 0.5f * b / a;
     else {
         float q = (b > 0) ?
-                  -0.5 * (b + sqrt(discr)) :
-                  -0.5 * (b - sqrt(discr));
+                  -0.5f * (b + sqrtf(discr)) :
+                  -0.5f * (b - sqrtf(discr));
         x0 = q / a;
         x1 = c / q;
     }
@@ -28,20 +69,6 @@ inline bool solveQuadratic(const float &a, const float &b, const float &c, float
     return true;
 }
 
-/*
-Note:
-on linux random_device would get one real random number
-but on windows it would get one pseudo random number which cause the BUG
-*/
-thread_local static RandomGen<float> StaticRandomGen(23333, 0.f, 1.f);
-inline float get_random_float(RandomGen<float> *random_gen = nullptr) {
-    if(random_gen == nullptr) {
-        return StaticRandomGen.get_random_float();
-    }
-    // distribution in range [1, 6]
-    return random_gen->get_random_float();
-}
-
 inline void UpdateProgress(float progress)
 {
     int barWidth = 70;
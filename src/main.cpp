@@ -2,9 +2,13 @@
 #include "Scene.hpp"
 #include "Triangle.hpp"
 #include "Sphere.hpp"
+#include "Instance.hpp"
 #include "Vector.hpp"
 #include "global.hpp"
 #include <chrono>
+#include <map>
+#include <memory>
+#include <string>
 // Code frame came from GAMES101.2020
 // In the main function of the program, we create the scene (create objects and
 // lights) as well as set the options for the render (image width and height,
@@ -14,6 +18,81 @@ int main(int argc, char** argv) {
     // Change the definition here to change resolution
     Scene scene(784, 784);
 
+    // positional arguments as listed in the README, options are given as --name or --name=value
+    std::vector<char*> args;
+    std::map<std::string, std::string> options;
+    for (int i = 0; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) == 0) {
+            size_t eq = arg.find('=');
+            options[arg.substr(2, eq == std::string::npos ? eq : eq - 2)] =
+                eq == std::string::npos ? "" : arg.substr(eq + 1);
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    // --merge[=<image>] <film>...: sums the film files of partial renders (--checkpoint with
+    // disjoint --sample-offset ranges) and saves the image instead of rendering
+    if(options.count("merge")) {
+        Film merged(scene.width, scene.height);
+        std::vector<std::pair<uint32_t, uint32_t>> ranges; // sample indices of every part
+        std::vector<FilmState> states;
+        for(size_t i = 1; i < args.size(); i++) {
+            Film part(scene.width, scene.height);
+            FilmState state;
+            std::string error;
+            if(!part.load(args[i], state, error)) {
+                std::cerr << "can not merge " << args[i] << ": " << error << "\n";
+                return 1;
+            }
+            uint32_t maxCount = 0;
+            for(const FilmPixel& pixel : part.pixels)
+                maxCount = std::max(maxCount, pixel.count);
+            for(size_t k = 0; k < ranges.size(); k++) {
+                bool sameSampler = states[k].samplerType == state.samplerType && states[k].seed == state.seed;
+                if(sameSampler && state.sampleOffset < ranges[k].second && ranges[k].first < state.sampleOffset + maxCount)
+                    std::cerr << "warning: " << args[i] << " repeats sample indices of " << args[k + 1] << "\n";
+            }
+            ranges.emplace_back(state.sampleOffset, state.sampleOffset + maxCount);
+            states.push_back(state);
+            merged.merge(part);
+        }
+        double reached = merged.sampleCount() / (double)merged.pixels.size();
+        std::clog << "merged " << ranges.size() << " films, " << reached << " spp on average\n";
+        char image_name[256];
+        if(options["merge"].empty())
+            sprintf(image_name, "image/%dx%d_%dspp_%d.ppm", scene.width, scene.height, int(reached), (int)std::time(0));
+        else
+            snprintf(image_name, sizeof(image_name), "%s", options["merge"].c_str());
+        std::vector<Vector3f> framebuffer = merged.image();
+        Renderer().SavePPM(image_name, scene.width, scene.height, framebuffer);
+        return 0;
+    }
+
+    // optional 4th argument picks the BVH node width: 2 (binary), 4 or 8
+    BVHAccel::NodeLayout layout = BVHAccel::NodeLayout::BINARY;
+    if(args.size() > 4) {
+        int arg_width = atol(args[4]);
+        layout = arg_width == 8 ? BVHAccel::NodeLayout::BVH8 :
+                 arg_width == 4 ? BVHAccel::NodeLayout::BVH4 : BVHAccel::NodeLayout::BINARY;
+    }
+    scene.nodeLayout = layout;
+
+    // optional 5th argument caps the number of primitives per BVH leaf
+    int leafSize = kTrianglePacketWidth;
+    if(args.size() > 5) {
+        int arg_leaf = atol(args[5]);
+        leafSize = arg_leaf > 0 ? arg_leaf : leafSize;
+    }
+    scene.maxPrimsInNode = leafSize;
+
+    // optional 6th argument limits the path length in bounces
+    if(args.size() > 6) {
+        int arg_depth = atol(args[6]);
+        scene.maxDepth = arg_depth >= 0 ? arg_depth : scene.maxDepth;
+    }
+
     Material* red = new Material(DIFFUSE, Vector3f(0.0f));
     red->albedo = Vector3f(0.63f, 0.065f, 0.05f);
     Material* green = new Material(DIFFUSE, Vector3f(0.0f));
@@ -38,13 +117,13 @@ int main(int argc, char** argv) {
     Material* gold = new Material(MICROFACET, Vector3f(0), 0.0001, 1.0);
     gold->albedo = Vector3f(1.00f, 0.71f, 0.29f);
 
-    MeshTriangle floor("./models/cornellbox/floor.obj", white_marble);
-    MeshTriangle shortbox("./models/cornellbox/shortbox.obj", copper);
-    MeshTriangle tallbox("./models/cornellbox/tallbox.obj", silver);
-    MeshTriangle left("./models/cornellbox/left.obj", red_plastic);
-    MeshTriangle right("./models/cornellbox/right.obj", green_plastic);
-    MeshTriangle light_("./models/cornellbox/light.obj", light);
-    MeshTriangle bunny("./models/bunny/bunny_big.obj", copper);
+    MeshTriangle floor("./models/cornellbox/floor.obj", white_marble, BVHAccel::SplitMethod::SAH, layout, leafSize);
+    MeshTriangle shortbox("./models/cornellbox/shortbox.obj", copper, BVHAccel::SplitMethod::SAH, layout, leafSize);
+    MeshTriangle tallbox("./models/cornellbox/tallbox.obj", silver, BVHAccel::SplitMethod::SAH, layout, leafSize);
+    MeshTriangle left("./models/cornellbox/left.obj", red_plastic, BVHAccel::SplitMethod::SAH, layout, leafSize);
+    MeshTriangle right("./models/cornellbox/right.obj", green_plastic, BVHAccel::SplitMethod::SAH, layout, leafSize);
+    MeshTriangle light_("./models/cornellbox/light.obj", light, BVHAccel::SplitMethod::SAH, layout, leafSize);
+    MeshTriangle bunny("./models/bunny/bunny_big.obj", copper, BVHAccel::SplitMethod::SAH, layout, leafSize);
     Sphere ball(Vector3f(138,120,334), 120, gold);
 
     scene.Add(&floor);
@@ -56,20 +135,101 @@ int main(int argc, char** argv) {
     scene.Add(&right);
     scene.Add(&light_);
 
-    scene.buildBVH();
+    // --instances=<n> adds n small copies of the bunny in a row above the boxes and a half size copy
+    // of the ceiling light, all placed with Instance over the meshes above
+    std::vector<std::unique_ptr<Instance>> instances;
+    int arg_instances = options.count("instances") ? std::max(0, atoi(options["instances"].c_str())) : 0;
+    if(arg_instances > 0) {
+        // about the center of the bunny's base, scaled down and turned a little more every copy
+        Transform bunnyToOrigin = Transform::Translate(Vector3f(-254.0f, 1.5f, -150.3f));
+        for(int k = 0; k < arg_instances; k++) {
+            float x = 556.0f * (k + 0.5f) / arg_instances;
+            Transform place = Transform::Translate(Vector3f(x, 380, 480)) *
+                              Transform::Rotate(360.0f * k / arg_instances, Vector3f(0, 1, 0)) *
+                              Transform::Scale(0.3f, 0.3f, 0.3f) * bunnyToOrigin;
+            instances.emplace_back(new Instance(&bunny, place));
+        }
+        Transform lightPlace = Transform::Translate(Vector3f(420, 548.7f, 430)) * Transform::Scale(0.5f, 0.5f, 0.5f) *
+                               Transform::Translate(Vector3f(-278, -548.7f, -279.5f));
+        instances.emplace_back(new Instance(&light_, lightPlace));
+        for(const std::unique_ptr<Instance>& instance : instances)
+            scene.Add(instance.get());
+    }
+
+    // --two-level keeps a BVH per mesh below one over the scene's objects instead of compiling
+    // every triangle into a single BVH
+    if(options.count("two-level"))
+        scene.buildBVH();
+    else
+        scene.compile();
 
     Renderer r;
     r.spp = 16;
     r.num_of_thread = 6;
-    if(argc > 2) {
-        int arg_spp = atol(argv[1]);
-        int arg_thread = atol(argv[2]);
+    if(args.size() > 2) {
+        int arg_spp = atol(args[1]);
+        int arg_thread = atol(args[2]);
         r.spp = arg_spp > 0 ? arg_spp : r.spp;
         r.num_of_thread = arg_thread > 0 ? arg_thread : r.num_of_thread;
     }
+    if(args.size() > 3) {
+        int arg_tile = atol(args[3]);
+        r.tile_size = arg_tile > 0 ? arg_tile : r.tile_size;
+    }
+    // optional 7th argument switches to the wavefront renderer with that many paths per thread
+    if(args.size() > 7) {
+        int arg_wavefront = atol(args[7]);
+        r.wavefront_size = arg_wavefront > 0 ? arg_wavefront : 0;
+    }
+    // optional 8th argument traces camera rays in packets of 8 or 16
+    if(args.size() > 8) {
+        int arg_packet = atol(args[8]);
+        r.packet_size = arg_packet > 0 ? arg_packet : 0;
+    }
+    // optional 9th argument picks the sampler: independent, stratified, halton or sobol (default)
+    if(args.size() > 9) {
+        std::string arg_sampler = args[9];
+        r.sampler_type = arg_sampler == "independent" ? SamplerType::INDEPENDENT :
+                         arg_sampler == "stratified" ? SamplerType::STRATIFIED :
+                         arg_sampler == "halton" ? SamplerType::HALTON : SamplerType::SOBOL;
+    }
+
+    // --adaptive=<relative error> spends the spp budget where pixels are noisiest,
+    // --sample-map also saves the samples every pixel received
+    if(options.count("adaptive")) {
+        float arg_threshold = atof(options["adaptive"].c_str());
+        r.adaptive_threshold = arg_threshold > 0 ? arg_threshold : 0.05f;
+        r.save_sample_map = options.count("sample-map") > 0;
+    }
+
+    // --time=<seconds> and/or --noise=<mean relative error> render progressively until either
+    // is reached, spp is then the upper limit
+    if(options.count("time") || options.count("noise")) {
+        r.time_budget = std::max(0.0, atof(options["time"].c_str()));
+        r.noise_target = std::max(0.0, atof(options["noise"].c_str()));
+    }
+
+    // --checkpoint=<file> saves the film every --checkpoint-interval=<seconds> (default 60) and at
+    // the end, --resume=<file> continues such a render towards spp; both render progressively
+    if(options.count("checkpoint")) {
+        r.checkpoint_path = options["checkpoint"];
+        if(options.count("checkpoint-interval"))
+            r.checkpoint_interval = std::max(0.0, atof(options["checkpoint-interval"].c_str()));
+    }
+    if(options.count("resume"))
+        r.resume_path = options["resume"];
+    // --sample-offset=<n> starts every pixel at sample index n, e.g. k * spp for the k-th of
+    // several processes rendering parts of one frame
+    if(options.count("sample-offset"))
+        r.sample_offset = (uint32_t)std::max(0L, atol(options["sample-offset"].c_str()));
 
     auto start = std::chrono::system_clock::now();
-    r.RenderMultithread(scene);
+    if(r.time_budget > 0 || r.noise_target > 0 || !r.checkpoint_path.empty() || !r.resume_path.empty())
+        r.RenderProgressive(scene);
+    else if(r.adaptive_threshold > 0)
+        r.RenderAdaptive(scene);
+    else
+        r.RenderMultithread(scene);
     auto stop = std::chrono::system_clock::now();
 
     std::clog << "Render complete: \n";